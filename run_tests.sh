@@ -11,6 +11,10 @@ morph-cli set hello world
 echo "get"
 morph-cli get hello
 
+echo "get long"
+morph-cli set long "this value is longer than the number of slots in a single ciphertext"
+morph-cli get long
+
 echo "get missing"
 morph-cli get missing
 
@@ -19,6 +23,7 @@ morph-cli mset key1 hello key2 world
 
 echo "mget"
 morph-cli mget key1 key2 missing
+morph-cli mgetpack 8 key1 key2 missing
 
 echo "keys"
 morph-cli keys "*"
@@ -35,3 +40,43 @@ morph-cli -h localhost info
 echo "set multiple times"
 morph-cli set hello world
 morph-cli get hello
+
+echo "interactive"
+printf "set session value\nget session\n" | morph-cli
+
+echo "pipe"
+printf "pipe1\tvalue1\nset pipe2 value2\n" | morph-cli --pipe
+morph-cli mget pipe1 pipe2
+
+echo "save"
+morph-cli save
+
+echo "bgsave"
+morph-cli bgsave
+
+echo "exists"
+morph-cli exists hello missing
+
+echo "scan"
+morph-cli scan 0 count 2
+
+echo "databases"
+printf "select 1\nset db1 value\ndbsize\nflushdb\n" | morph-cli
+
+echo "expiration"
+morph-cli setex expiring 100 value
+morph-cli set expiring2 value ex 100
+morph-cli get expiring
+
+echo "dump and restore"
+morph-cli restore restored value
+morph-cli dump 0 2
+
+echo "stats"
+morph-cli info commandstats
+morph-cli latency histogram get
+morph-cli slowlog get
+morph-cli info heops
+morph-cli info memory
+morph-cli debug heops 1
+morph-cli command info get
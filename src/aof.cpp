@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "aof.h"
+#include "resp.h"
+
+namespace morph {
+
+AppendOnlyFile::AppendOnlyFile(const std::string& path, FSYNC_POLICY policy) {
+  path_ = path;
+  policy_ = policy;
+  open();
+
+  // fsync in the background so writes don't wait on the disk
+  if (policy_ == FSYNC_EVERYSEC) {
+    sync_thread_ = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!stop_) {
+        cv_.wait_for(lock, std::chrono::seconds(1));
+        if (dirty_.exchange(false)) {
+          sync();
+        }
+      }
+    });
+  }
+}
+
+AppendOnlyFile::~AppendOnlyFile() {
+  flush();
+  if (sync_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    sync_thread_.join();
+  }
+  if (policy_ != FSYNC_NO) {
+    sync();
+  }
+  close(fd_);
+}
+
+void AppendOnlyFile::open() {
+  fd_ = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd_ == -1) {
+    std::cerr << "Error opening append only file: " << path_ << ": " << std::strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+void AppendOnlyFile::sync() {
+  if (fsync(fd_) != 0) {
+    std::cerr << "Error syncing append only file: " << std::strerror(errno) << std::endl;
+    exit(1);
+  }
+}
+
+void AppendOnlyFile::append(const std::vector<std::string>& cmd) {
+  buffer_ += respArray(cmd);
+}
+
+void AppendOnlyFile::flush() {
+  if (buffer_.empty()) {
+    return;
+  }
+
+  size_t written = 0;
+  while (written < buffer_.size()) {
+    auto result = write(fd_, buffer_.data() + written, buffer_.size() - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      // replies can't be sent without the data
+      std::cerr << "Error writing append only file: " << std::strerror(errno) << std::endl;
+      exit(1);
+    }
+    written += result;
+  }
+  buffer_.clear();
+
+  if (policy_ == FSYNC_ALWAYS) {
+    sync();
+  } else if (policy_ == FSYNC_EVERYSEC) {
+    dirty_ = true;
+  }
+}
+
+void AppendOnlyFile::reopen() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  close(fd_);
+  open();
+}
+
+void AppendOnlyFile::load(const std::string& path, Databases& dbs, const std::function<void(std::vector<std::string>&)>& fn) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Error opening file: " + path);
+  }
+
+  struct stat buf;
+  if (fstat(fd, &buf) != 0) {
+    close(fd);
+    throw std::runtime_error("Error reading file: " + path);
+  }
+  size_t size = buf.st_size;
+  if (size == 0) {
+    close(fd);
+    return;
+  }
+
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    throw std::runtime_error("Error mapping file: " + path);
+  }
+  const char* data = static_cast<const char*>(map);
+
+  size_t pos = 0;
+  try {
+    // rewrites start the file with a snapshot
+    if (Store::isSnapshot(data, size)) {
+      pos = loadSnapshot(data, size, dbs);
+    }
+
+    while (pos < size) {
+      std::vector<std::string> cmd;
+      auto len = readCommand(data + pos, size - pos, cmd);
+      if (len < 0) {
+        throw std::runtime_error("Bad append only file: " + path);
+      }
+      if (len == 0) {
+        break;
+      }
+      pos += len;
+      if (!cmd.empty()) {
+        fn(cmd);
+      }
+    }
+  } catch (...) {
+    munmap(map, size);
+    throw;
+  }
+  munmap(map, size);
+
+  // a crash can leave a partial command at the end
+  if (pos < size) {
+    std::cerr << "Truncating incomplete command at end of append only file" << std::endl;
+    if (truncate(path.c_str(), pos) != 0) {
+      throw std::runtime_error("Error truncating file: " + path);
+    }
+  }
+}
+
+} // namespace morph
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "store.h"
+
+namespace morph {
+
+enum FSYNC_POLICY { FSYNC_ALWAYS, FSYNC_EVERYSEC, FSYNC_NO };
+
+class AppendOnlyFile {
+  public:
+    AppendOnlyFile(const std::string& path, FSYNC_POLICY policy);
+    ~AppendOnlyFile();
+
+    // buffers the command until the next flush
+    void append(const std::vector<std::string>& cmd);
+    // writes all commands buffered since the last flush at once
+    // call before sending replies so clients only see durable writes
+    void flush();
+    // call after the file is replaced by a rewrite
+    void reopen();
+
+    // loads the snapshot preamble, if any, then calls fn for each command
+    static void load(const std::string& path, Databases& dbs, const std::function<void(std::vector<std::string>&)>& fn);
+
+  private:
+    std::string path_;
+    FSYNC_POLICY policy_;
+    int fd_ = -1;
+    std::string buffer_;
+
+    std::thread sync_thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<bool> dirty_{false};
+    bool stop_ = false;
+
+    void open();
+    void sync();
+};
+
+} // namespace morph
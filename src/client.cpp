@@ -14,27 +14,75 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <stdexcept>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
 #include "client.h"
 #include "encryption.h"
 #include "network.h"
+#include "parallel.h"
 #include "resp.h"
 
 namespace morph {
 
-void Client::keygen() {
-  generateKeys();
+// part of a command sent to a single server
+struct Request {
+  Request(size_t command, size_t shard, std::vector<std::string> args) : command(command), shard(shard), args(std::move(args)) {}
+
+  size_t command;
+  size_t shard;
+  std::vector<std::string> args;
+  // positions of keys in the original command
+  std::vector<size_t> positions;
+  std::string reply;
+  Result result;
+};
+
+Client::Client() {
+  servers_.emplace_back(options_.hostname, options_.port);
+  connections_.resize(1, -1);
+  buffers_.resize(1);
 }
 
-// TODO return std::optional<std::string>
-std::string decrypt(morph::Encryptor& encryptor, const std::string& str) {
-  auto decrypted = encryptor.decrypt(str);
-  if (decrypted.empty()) {
-    return decrypted;
+Client::Client(ClientOptions& options) {
+  options_ = options;
+  if (options_.servers.empty()) {
+    servers_.emplace_back(options_.hostname, options_.port);
+  } else {
+    servers_ = options_.servers;
+  }
+  connections_.resize(servers_.size(), -1);
+  buffers_.resize(servers_.size());
+}
+
+Client::~Client() {
+  for (auto connection : connections_) {
+    if (connection != -1) {
+      close(connection);
+    }
+  }
+}
+
+Encryptor& Client::encryptor() {
+  if (!encryptor_) {
+    encryptor_ = std::make_unique<Encryptor>(options_.sk_path);
+  }
+  return *encryptor_;
+}
+
+void Client::keygen(uint32_t buckets) {
+  generateKeys(buckets);
+}
+
+// value from decrypted slots
+std::string plaintextValue(const std::string& decrypted) {
+  if (decrypted.empty() || decrypted[0] == 0x00) {
+    return "";
   }
   if (decrypted[0] != '+') {
     return "(set multiple times)";
@@ -44,40 +92,264 @@ std::string decrypt(morph::Encryptor& encryptor, const std::string& str) {
   return std::string(decrypted.substr(1).c_str());
 }
 
-Result Client::execute(std::vector<std::string>& args) {
+// TODO return std::optional<std::string>
+std::string decrypt(morph::Encryptor& encryptor, const std::string& str) {
+  return plaintextValue(encryptor.decrypt(str));
+}
+
+// a packed value that filled its range, so it may have been cut off
+const std::string PACK_OVERFLOW = "(longer than pack width)";
+
+std::string address(const std::pair<std::string, int>& server) {
+  return server.first + ":" + std::to_string(server.second);
+}
+
+int Client::connection(size_t shard) {
+  if (connections_[shard] == -1) {
+    std::string err;
+    connections_[shard] = connTryOpen(servers_[shard].first.c_str(), servers_[shard].second, err);
+    if (connections_[shard] == -1) {
+      throw std::runtime_error("Could not connect to Morph at " + address(servers_[shard]) + ": " + err);
+    }
+  }
+  return connections_[shard];
+}
+
+// reconnect on the next command
+void Client::resetConnection(size_t shard) {
+  if (connections_[shard] != -1) {
+    close(connections_[shard]);
+    connections_[shard] = -1;
+  }
+  buffers_[shard].clear();
+}
+
+// position of the options after the key and value of set, or the number of arguments
+size_t optionStart(const std::vector<std::string>& args) {
+  std::string command = args[0];
+  for (auto &c : command) {
+    c = tolower(c);
+  }
+  if (command == "set") {
+    return std::min<size_t>(3, args.size());
+  }
+  return args.size();
+}
+
+// msetex and mgetpack take their option first, like setex, so no key or value is mistaken for one
+size_t keysStart(const std::string& command) {
+  return command == "msetex" || command == "mgetpack" ? 2 : 1;
+}
+
+void Client::route(size_t index, const std::vector<std::string>& args, std::vector<Request>& requests) {
+  size_t shards = servers_.size();
+  if (shards == 1) {
+    requests.push_back({index, 0, args});
+    return;
+  }
+
+  std::string command = args[0];
+  for (auto &c : command) {
+    c = tolower(c);
+  }
+
+  // the keyed hash of the plaintext key picks the server
+  auto shard = [&](const std::string& key) {
+    return encryptor().hash(key) % shards;
+  };
+
+  size_t first = keysStart(command);
+  size_t end = optionStart(args);
+  bool pairs = command == "mset" || command == "msetex";
+  if ((command == "set" || command == "setex" || command == "get") && args.size() >= 2) {
+    requests.push_back({index, shard(args[1]), args});
+  } else if ((pairs && end >= first + 2 && (end - first) % 2 == 0) || ((command == "mget" || command == "mgetpack" || command == "exists") && args.size() > first)) {
+    size_t step = pairs ? 2 : 1;
+    std::vector<long> parts(shards, -1);
+    for (size_t i = first; i < end; i += step) {
+      auto s = shard(args[i]);
+      if (parts[s] == -1) {
+        parts[s] = requests.size();
+        requests.push_back({index, s, {args.begin(), args.begin() + first}});
+      }
+      auto& request = requests[parts[s]];
+      request.args.insert(request.args.end(), args.begin() + i, args.begin() + i + step);
+      request.positions.push_back((i - first) / step);
+    }
+    // every part gets the option
+    for (auto p : parts) {
+      if (p != -1) {
+        requests[p].args.insert(requests[p].args.end(), args.begin() + end, args.end());
+      }
+    }
+  } else {
+    for (size_t s = 0; s < shards; s++) {
+      requests.push_back({index, s, args});
+    }
+  }
+}
+
+Result Client::merge(const std::vector<std::string>& args, std::vector<Request*>& parts) {
+  if (parts.size() == 1 && parts[0]->positions.empty()) {
+    return parts[0]->result;
+  }
+
+  for (auto part : parts) {
+    if (part->result.type == RESP_ERROR) {
+      return part->result;
+    }
+  }
+
+  std::string command = args[0];
+  for (auto &c : command) {
+    c = tolower(c);
+  }
+
+  Result res = parts[0]->result;
+  if (command == "mget" || command == "mgetpack") {
+    res.value_arr.assign(args.size() - keysStart(command), "");
+    for (auto part : parts) {
+      for (size_t i = 0; i < part->positions.size(); i++) {
+        res.value_arr[part->positions[i]] = part->result.value_arr.at(i);
+      }
+    }
+  } else if (command == "dbsize" || command == "exists") {
+    for (size_t i = 1; i < parts.size(); i++) {
+      res.value_int += parts[i]->result.value_int;
+    }
+  } else if (command == "keys") {
+    for (size_t i = 1; i < parts.size(); i++) {
+      auto& arr = parts[i]->result.value_arr;
+      res.value_arr.insert(res.value_arr.end(), arr.begin(), arr.end());
+    }
+  }
+  return res;
+}
+
+// commands with arguments and replies that aren't data
+bool plaintextCommand(const std::string& command) {
+  return command == "info" || command == "latency" || command == "slowlog" || command == "debug" || command == "command" || command == "select" || command == "replicaof" || command == "delrange" || command == "migrate";
+}
+
+// tags keys with their bucket so the server only scans that bucket
+void Client::addBuckets(const std::vector<std::string>& args, size_t end, std::vector<std::string>& arr) {
+  const auto& command = args[0];
+  std::vector<std::string> keys;
+  if ((command == "set" || command == "setex" || command == "get") && args.size() >= 2) {
+    keys.push_back(args[1]);
+  } else if (command == "mset") {
+    for (size_t i = 1; i < end; i += 2) {
+      keys.push_back(args[i]);
+    }
+  } else if (command == "mget" || command == "exists") {
+    keys.assign(args.begin() + 1, args.begin() + end);
+  }
+  if (keys.empty()) {
+    return;
+  }
+  arr.push_back("buckets");
+  for (const auto& key : keys) {
+    arr.push_back(std::to_string(encryptor().bucket(key)));
+  }
+}
+
+std::string Client::encode(const std::vector<std::string>& command) {
+  // msetex and mgetpack are sent as mset with EX and mget with PACK after the keys
+  std::vector<std::string> args = command;
+  size_t end = optionStart(args);
+  if ((command[0] == "msetex" || command[0] == "mgetpack") && command.size() >= 2) {
+    bool mset = command[0] == "msetex";
+    args = {mset ? "mset" : "mget"};
+    args.insert(args.end(), command.begin() + 2, command.end());
+    end = args.size();
+    args.insert(args.end(), {mset ? "ex" : "pack", command[1]});
+  }
+
   // encrypt
-  auto encryptor = morph::Encryptor(options_.sk_path);
+  auto& encryptor = this->encryptor();
   std::vector<std::string> arr;
+  // dump and scan have positions as arguments but reply with data
+  bool plaintext = plaintextCommand(args[0]) || args[0] == "dump" || args[0] == "scan";
   for (int i = 0; i < args.size(); i++) {
-    if (i == 0 || (args[0] == "keys" && args[i] == "*")) {
+    if (i == 0 || plaintext || (args[0] == "keys" && args[i] == "*") || i >= end || (args[0] == "setex" && i == 2)) {
       arr.push_back(args[i]);
     } else {
       // TODO use hash of data instead?
-      arr.push_back(encryptor.encrypt("+" + args[i]));
+      // values can span several chunks, but keys are compared in one
+      bool value = (args[0] == "set" && i == 2) || (args[0] == "setex" && i == 3) || (args[0] == "mset" && i % 2 == 0);
+      arr.push_back(value ? encryptor.encryptChunks("+" + args[i]) : encryptor.encrypt("+" + args[i]));
     }
   }
   if (args[0] == "keys" && args.size() == 1) {
     arr.push_back("*");
   }
+  if (encryptor.buckets() > 0) {
+    addBuckets(args, end, arr);
+  }
 
   // serialize
-  auto serialized = respArray(arr);
-
-  // send and receive
-  auto sock = connSend(options_.hostname.c_str(), options_.port, serialized);
-  char buffer[1048576] = {0};
-  auto bytesRead = connRead(sock, buffer, 1048576);
-  if (bytesRead <= 0) {
-    // TODO throw error
-    std::cerr << "No bytes read" << std::endl;
-    exit(1);
-  }
+  return respArray(arr);
+}
 
+Result Client::decode(const std::vector<std::string>& args, const std::string& reply) {
   // deserialize
-  auto res = readResult(std::string(buffer, bytesRead));
+  auto res = readResult(reply);
 
   // decrypt
-  if (res.type == RESP_BULK_STRING && args[0] != "info") {
+  auto& encryptor = this->encryptor();
+  if (plaintextCommand(args[0])) {
+    return res;
+  }
+  // the count is in the first slot, and decrypts to empty when 0
+  if (args[0] == "exists") {
+    if (res.type == RESP_BULK_STRING) {
+      auto decrypted = encryptor.decrypt(res.value_str);
+      res.type = RESP_INTEGER;
+      res.value_int = decrypted.empty() ? 0 : static_cast<unsigned char>(decrypted[0]);
+      res.value_str.clear();
+    }
+    return res;
+  }
+  // the next cursor and a batch of keys
+  if (args[0] == "scan") {
+    if (res.type == RESP_ARRAY && res.elements.size() == 2) {
+      auto& keys = res.elements[1];
+      parallelFor(keys.elements.size(), [&](size_t i) {
+        keys.elements[i].value_str = decrypt(encryptor, keys.elements[i].value_str);
+        keys.value_arr[i] = keys.elements[i].value_str;
+      });
+    }
+    return res;
+  }
+  // each reply has values in ranges of width slots, as many as fit
+  if (args[0] == "mgetpack") {
+    if (res.type == RESP_ARRAY) {
+      size_t width = std::stoul(args[1]);
+      size_t per = encryptor.slots() / width;
+      std::vector<std::string> values(args.size() - 2);
+      parallelFor(res.value_arr.size(), [&](size_t i) {
+        auto decrypted = encryptor.decryptSlots(res.value_arr[i]);
+        for (size_t j = 0; j < per && i * per + j < values.size(); j++) {
+          auto slots = decrypted.empty() ? "" : decrypted.substr(j * width, width);
+          values[i * per + j] = !slots.empty() && slots[0] != 0x00 && slots.back() != 0x00 ? PACK_OVERFLOW : plaintextValue(slots);
+        }
+      });
+      res.value_arr = values;
+      res.elements.clear();
+    }
+    return res;
+  }
+  // entries are followed by their expiration times and bucket tags as restore options
+  if (args[0] == "dump") {
+    if (res.type == RESP_ARRAY) {
+      auto end = std::find_if(res.value_arr.begin(), res.value_arr.end(), [](const std::string& arg) { return arg == "expires" || arg == "buckets"; });
+      parallelFor(end - res.value_arr.begin(), [&](size_t i) {
+        res.value_arr[i] = decrypt(encryptor, res.value_arr[i]);
+      });
+    }
+    return res;
+  }
+  if (res.type == RESP_BULK_STRING) {
     res.value_str = decrypt(encryptor, res.value_str);
   } else if (res.type == RESP_ARRAY) {
     for (int i = 0; i < res.value_arr.size(); i++) {
@@ -88,8 +360,79 @@ Result Client::execute(std::vector<std::string>& args) {
   return res;
 }
 
-bool Client::set(const std::string& key, const std::string& value) {
+Result Client::execute(std::vector<std::string>& args) {
+  std::vector<std::vector<std::string>> cmds {args};
+  return pipeline(cmds)[0];
+}
+
+std::vector<Result> Client::pipeline(std::vector<std::vector<std::string>>& cmds) {
+  // load key before starting threads
+  encryptor();
+
+  std::vector<Request> requests;
+  for (size_t i = 0; i < cmds.size(); i++) {
+    route(i, cmds[i], requests);
+  }
+
+  std::vector<std::string> encoded(requests.size());
+  parallelFor(requests.size(), [&](size_t i) {
+    encoded[i] = encode(requests[i].args);
+  });
+
+  // send to all servers before reading any replies
+  std::vector<std::string> serialized(servers_.size());
+  for (size_t i = 0; i < requests.size(); i++) {
+    serialized[requests[i].shard] += encoded[i];
+    encoded[i].clear();
+  }
+  std::vector<size_t> unread(servers_.size());
+  for (auto& request : requests) {
+    unread[request.shard]++;
+  }
+  try {
+    for (size_t s = 0; s < servers_.size(); s++) {
+      if (!serialized[s].empty() && !connWrite(connection(s), serialized[s])) {
+        throw std::runtime_error("Error writing to " + address(servers_[s]));
+      }
+    }
+
+    // replies from each server are in order
+    for (auto& request : requests) {
+      if (!connReadReply(connection(request.shard), buffers_[request.shard], request.reply)) {
+        throw std::runtime_error("Error reading from " + address(servers_[request.shard]));
+      }
+      unread[request.shard]--;
+    }
+  } catch (const std::runtime_error& e) {
+    // replies left on other servers would otherwise go to the next command
+    for (size_t s = 0; s < servers_.size(); s++) {
+      if (unread[s] > 0) {
+        resetConnection(s);
+      }
+    }
+    throw;
+  }
+
+  parallelFor(requests.size(), [&](size_t i) {
+    requests[i].result = decode(requests[i].args, requests[i].reply);
+  });
+
+  std::vector<std::vector<Request*>> parts(cmds.size());
+  for (auto& request : requests) {
+    parts[request.command].push_back(&request);
+  }
+  std::vector<Result> results(cmds.size());
+  for (size_t i = 0; i < cmds.size(); i++) {
+    results[i] = merge(cmds[i], parts[i]);
+  }
+  return results;
+}
+
+bool Client::set(const std::string& key, const std::string& value, long seconds) {
   std::vector<std::string> args {"set", key, value};
+  if (seconds > 0) {
+    args.insert(args.end(), {"ex", std::to_string(seconds)});
+  }
   auto res = execute(args);
   return res.value_str == "OK";
 }
@@ -100,11 +443,91 @@ std::optional<std::string> Client::get(const std::string& key) {
   return res.value_str.empty() ? std::nullopt : std::optional<std::string>{res.value_str};
 }
 
+bool Client::mset(const std::vector<std::pair<std::string, std::string>>& pairs, long seconds) {
+  std::vector<std::string> args {"mset"};
+  if (seconds > 0) {
+    args = {"msetex", std::to_string(seconds)};
+  }
+  for (const auto& pair : pairs) {
+    args.push_back(pair.first);
+    args.push_back(pair.second);
+  }
+  auto res = execute(args);
+  return res.value_str == "OK";
+}
+
+std::vector<std::optional<std::string>> Client::mget(const std::vector<std::string>& keys, size_t pack) {
+  std::vector<std::string> args {"mget"};
+  if (pack > 0) {
+    args = {"mgetpack", std::to_string(pack)};
+  }
+  args.insert(args.end(), keys.begin(), keys.end());
+  auto res = execute(args);
+  std::vector<std::optional<std::string>> values;
+  for (size_t i = 0; i < res.value_arr.size(); i++) {
+    const auto& value = res.value_arr[i];
+    if (pack > 0 && value == PACK_OVERFLOW) {
+      values.push_back(get(keys[i]));
+    } else {
+      values.push_back(value.empty() ? std::nullopt : std::optional<std::string>{value});
+    }
+  }
+  return values;
+}
+
+int Client::exists(const std::vector<std::string>& keys) {
+  std::vector<std::string> args {"exists"};
+  args.insert(args.end(), keys.begin(), keys.end());
+  auto res = execute(args);
+  return res.value_int;
+}
+
 void Client::flushall() {
   std::vector<std::string> args {"flushall"};
   execute(args);
 }
 
+void Client::scan(const std::function<bool(const std::vector<std::string>&)>& fn, size_t count) {
+  // load key before starting threads
+  encryptor();
+
+  // one server at a time, with one batch in memory
+  for (size_t s = 0; s < servers_.size(); s++) {
+    std::string cursor = "0";
+    do {
+      std::vector<std::string> args {"scan", cursor, "count", std::to_string(count)};
+      std::string reply;
+      bool written = connWrite(connection(s), encode(args));
+      if (!written || !connReadReply(connection(s), buffers_[s], reply)) {
+        resetConnection(s);
+        throw std::runtime_error((written ? "Error reading from " : "Error writing to ") + address(servers_[s]));
+      }
+      auto res = decode(args, reply);
+      if (res.type == RESP_ERROR) {
+        throw std::runtime_error(res.value_str);
+      }
+      if (res.type != RESP_ARRAY || res.elements.size() != 2) {
+        throw std::runtime_error("Unexpected reply to scan");
+      }
+      cursor = res.elements[0].value_str;
+      if (!fn(res.elements[1].value_arr)) {
+        return;
+      }
+    } while (cursor != "0");
+  }
+}
+
+void Client::flushdb() {
+  std::vector<std::string> args {"flushdb"};
+  execute(args);
+}
+
+bool Client::select(int db) {
+  std::vector<std::string> args {"select", std::to_string(db)};
+  auto res = execute(args);
+  return res.value_str == "OK";
+}
+
 int Client::dbsize() {
   std::vector<std::string> args {"dbsize"};
   auto res = execute(args);
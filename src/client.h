@@ -16,46 +16,89 @@
 
 #pragma once
 
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "resp.h"
 
 namespace morph {
 
+class Encryptor;
+
 struct ClientOptions {
   std::string hostname = "127.0.0.1";
   int port = 6774;
   std::string sk_path = "morph.sk";
+  // hostname and port of each server to shard keys across
+  // used instead of hostname and port when set
+  std::vector<std::pair<std::string, int>> servers;
 };
 
+struct Request;
+
 class Client {
   public:
-    Client() {}
-    Client(ClientOptions& options) {
-      options_ = options;
-    }
+    Client();
+    Client(ClientOptions& options);
+    ~Client();
 
-    void keygen();
+    // buckets enable the bucketed index, which leaks which keys share a bucket
+    void keygen(uint32_t buckets = 0);
 
     // TODO support dynamic args
     // TODO better return type
     Result execute(std::vector<std::string>& cmd);
 
-    bool set(const std::string& key, const std::string& value);
-    std::optional<std::string> get(const std::string& key);
+    // encrypts in parallel and sends all commands before reading replies
+    // throws std::runtime_error if a server can't be reached, and reconnects on the next call
+    std::vector<Result> pipeline(std::vector<std::vector<std::string>>& cmds);
 
-    // TODO add mset and mget
+    // expire after the given number of seconds, or never when 0
+    bool set(const std::string& key, const std::string& value, long seconds = 0);
+    std::optional<std::string> get(const std::string& key);
+    bool mset(const std::vector<std::pair<std::string, std::string>>& pairs, long seconds = 0);
+    // pack returns values in ranges of that many slots, so fewer ciphertexts are sent and decrypted,
+    // and gets values that don't fit separately
+    std::vector<std::optional<std::string>> mget(const std::vector<std::string>& keys, size_t pack = 0);
+    // number of entries with the keys, modulo the plaintext modulus
+    int exists(const std::vector<std::string>& keys);
 
     void flushall();
+    void flushdb();
+    // applies to the rest of the connection
+    bool select(int db);
     int dbsize();
     std::vector<std::string> keys(const std::string& pattern = "*");
+    // calls fn with each batch of keys as it arrives, across all servers,
+    // and stops early if it returns false
+    // throws std::runtime_error if a server can't be reached or replies with an error
+    void scan(const std::function<bool(const std::vector<std::string>&)>& fn, size_t count = 100);
     std::string info();
 
+    // encrypts and serializes a command for a single server
+    // so it can be sent later, like for load testing
+    std::string encode(const std::vector<std::string>& args);
+
   private:
     ClientOptions options_;
+    // loaded on first use and kept for the life of the client
+    std::unique_ptr<Encryptor> encryptor_;
+    std::vector<std::pair<std::string, int>> servers_;
+    std::vector<int> connections_;
+    std::vector<std::string> buffers_;
+
+    Encryptor& encryptor();
+    int connection(size_t shard);
+    void resetConnection(size_t shard);
+    void route(size_t index, const std::vector<std::string>& args, std::vector<Request>& requests);
+    Result merge(const std::vector<std::string>& args, std::vector<Request*>& parts);
+    Result decode(const std::vector<std::string>& args, const std::string& reply);
+    void addBuckets(const std::vector<std::string>& args, size_t end, std::vector<std::string>& arr);
 };
 
 } // namespace morph
@@ -15,11 +15,13 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <sys/stat.h>
 
 #include "encryption.h"
+#include "hash.h"
 
 namespace morph {
 
@@ -29,6 +31,35 @@ std::string ctxtToString(const helib::Ctxt& ctxt) {
   return oss.str();
 }
 
+std::string chunksToString(const std::vector<helib::Ctxt>& chunks) {
+  std::ostringstream oss;
+  for (const auto& chunk : chunks) {
+    chunk.writeTo(oss);
+  }
+  return oss.str();
+}
+
+std::vector<helib::Ctxt> readChunks(std::istream& is, const helib::PubKey& pk) {
+  std::vector<helib::Ctxt> chunks;
+  do {
+    chunks.push_back(helib::Ctxt::readFrom(is, pk));
+  } while (is.peek() != EOF);
+  return chunks;
+}
+
+uint64_t contextFingerprint(const helib::Context& context) {
+  std::ostringstream oss;
+  context.writeTo(oss);
+
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : oss.str()) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
 bool fileExists(const std::string& filename) {
   struct stat buf;
   return stat(filename.c_str(), &buf) == 0;
@@ -49,7 +80,9 @@ std::ofstream createFile(const std::string& filename) {
   return file;
 }
 
-void generateKeys() {
+const char BUCKETS_MAGIC[8] = {'M', 'O', 'R', 'P', 'H', 'B', 'K', 'T'};
+
+void generateKeys(uint32_t buckets) {
   unsigned long p = 131;
   unsigned long m = 130;
   unsigned long r = 1;
@@ -66,6 +99,10 @@ void generateKeys() {
   auto sk_file = createFile("morph.sk");
   contextp->writeTo(sk_file);
   secret_key.writeTo(sk_file, false);
+  if (buckets > 0) {
+    sk_file.write(BUCKETS_MAGIC, sizeof(BUCKETS_MAGIC));
+    sk_file.write(reinterpret_cast<const char*>(&buckets), sizeof(buckets));
+  }
   sk_file.close();
 
   auto pk_file = createFile("morph.pk");
@@ -74,8 +111,25 @@ void generateKeys() {
   pk_file.close();
 }
 
+uint32_t readBuckets(const std::string& sk_path) {
+  std::ifstream file(sk_path, std::ios::binary | std::ios::ate);
+  char magic[sizeof(BUCKETS_MAGIC)];
+  uint32_t buckets = 0;
+  if (!file.is_open() || file.tellg() < static_cast<std::streamoff>(sizeof(magic) + sizeof(buckets))) {
+    return 0;
+  }
+  file.seekg(-static_cast<std::streamoff>(sizeof(magic) + sizeof(buckets)), std::ios::end);
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char*>(&buckets), sizeof(buckets));
+  if (!file || memcmp(magic, BUCKETS_MAGIC, sizeof(magic)) != 0) {
+    return 0;
+  }
+  return buckets;
+}
+
+// safe to call from multiple threads
 std::string Encryptor::encrypt(const std::string& value) {
-  helib::PubKey public_key = *skp_;
+  const helib::PubKey& public_key = *skp_;
 
   helib::Ptxt<helib::BGV> plaintext_value(public_key.getContext());
   for (long i = 0; i < value.size(); ++i) {
@@ -88,27 +142,68 @@ std::string Encryptor::encrypt(const std::string& value) {
   return ctxtToString(encrypted_value);
 }
 
+// safe to call from multiple threads
+std::string Encryptor::encryptChunks(const std::string& value) {
+  size_t slots = this->slots();
+  if (value.size() <= slots) {
+    return encrypt(value);
+  }
+  std::string str;
+  for (size_t i = 0; i < value.size(); i += slots) {
+    str += encrypt(value.substr(i, slots));
+  }
+  return str;
+}
+
 std::string Encryptor::decrypt(const std::string& str) {
+  auto string_result = decryptSlots(str);
+  if (string_result.empty() || string_result.at(0) == 0x00) {
+    return "";
+  } else {
+    return string_result;
+  }
+}
+
+std::string Encryptor::decryptSlots(const std::string& str) {
   if (str.empty()) {
     return "";
   }
 
   std::istringstream iss(str);
-  helib::Ctxt encrypted_result = helib::Ctxt::readFrom(iss, *skp_.get());
-
-  helib::Ptxt<helib::BGV> plaintext_result(skp_->getContext());
-  skp_->Decrypt(plaintext_result, encrypted_result);
-
   std::string string_result;
-  for (long i = 0; i < plaintext_result.size(); ++i) {
-    string_result.push_back(static_cast<long>(plaintext_result[i]));
-  }
+  for (const auto& encrypted_result : readChunks(iss, *skp_)) {
+    helib::Ptxt<helib::BGV> plaintext_result(skp_->getContext());
+    skp_->Decrypt(plaintext_result, encrypted_result);
 
-  if (string_result.at(0) == 0x00) {
-    return "";
-  } else {
-    return string_result;
+    for (long i = 0; i < plaintext_result.size(); ++i) {
+      string_result.push_back(static_cast<long>(plaintext_result[i]));
+    }
   }
+  return string_result;
+}
+
+uint64_t Encryptor::hash(const std::string& value) {
+  std::call_once(hash_key_flag_, [this]() {
+    std::ostringstream oss;
+    skp_->writeTo(oss, true);
+    auto sk = oss.str();
+
+    // derive separate halves with fixed keys
+    uint8_t derive_key[16] = {'m', 'o', 'r', 'p', 'h', '-', 'h', 'a', 's', 'h', '-', 'k', 'e', 'y', 0, 0};
+    for (int i = 0; i < 2; i++) {
+      derive_key[15] = i;
+      uint64_t half = siphash(derive_key, sk.data(), sk.size());
+      for (int j = 0; j < 8; j++) {
+        hash_key_[i * 8 + j] = (half >> (8 * j)) & 0xff;
+      }
+    }
+  });
+  return siphash(hash_key_, value.data(), value.size());
+}
+
+uint32_t Encryptor::bucket(const std::string& key) {
+  // prefix keeps tags independent of shard routing
+  return hash(std::string("\0bucket", 7) + key) % buckets_;
 }
 
 } // namespace morph
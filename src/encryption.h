@@ -17,8 +17,10 @@
 
 #pragma once
 
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -29,6 +31,15 @@ namespace morph {
 
 std::string ctxtToString(const helib::Ctxt& ctxt);
 
+// values longer than the slot count are split into chunks,
+// which are serialized one after another
+std::string chunksToString(const std::vector<helib::Ctxt>& chunks);
+// reads chunks until the end of the stream
+std::vector<helib::Ctxt> readChunks(std::istream& is, const helib::PubKey& pk);
+
+// identifies the parameters data was encrypted with
+uint64_t contextFingerprint(const helib::Context& context);
+
 bool fileExists(const std::string& filename);
 
 template <typename T1, typename T2>
@@ -60,20 +71,40 @@ uniq_pair<helib::Context, KEY> loadContextAndKey(const std::string& filename, bo
   return {std::move(contextp), std::move(keyp)};
 }
 
-void generateKeys();
+// buckets for the opt-in bucketed index, or 0 to disable it
+void generateKeys(uint32_t buckets = 0);
+
+// number of buckets stored after the secret key, or 0 for older key files
+uint32_t readBuckets(const std::string& sk_path);
 
 class Encryptor {
   public:
     Encryptor(const std::string& sk_path) {
       std::tie(contextp_, skp_) = loadContextAndKey<helib::SecKey>(sk_path, true);
+      buckets_ = readBuckets(sk_path);
     }
     std::string encrypt(const std::string& value);
+    // one ciphertext per slot count, so values can be longer than it
+    std::string encryptChunks(const std::string& value);
     std::string decrypt(const std::string& value);
+    // every slot of every chunk, including empty ones at the start
+    std::string decryptSlots(const std::string& value);
+    size_t slots() const { return contextp_->getEA().size(); }
+    // keyed hash with a key derived from the secret key
+    // so servers can't compute it
+    uint64_t hash(const std::string& value);
+    // number of buckets, or 0 when the bucketed index is disabled
+    uint32_t buckets() const { return buckets_; }
+    // bucket tag for a key, from the same keyed hash with a separate domain
+    uint32_t bucket(const std::string& key);
 
   private:
     std::vector<std::pair<helib::Ctxt, helib::Ctxt>> store_;
     std::shared_ptr<helib::Context> contextp_;
     std::unique_ptr<helib::SecKey> skp_;
+    uint8_t hash_key_[16];
+    std::once_flag hash_key_flag_;
+    uint32_t buckets_ = 0;
 };
 
 } // namespace morph
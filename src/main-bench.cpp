@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <helib/helib.h>
+
+#include "encryption.h"
+#include "resp.h"
+#include "store.h"
+#include "version.h"
+
+struct Options {
+  std::vector<std::string> args;
+  bool help = false;
+  bool version = false;
+  std::string pk_path = "morph.pk";
+  std::string sk_path = "morph.sk";
+  std::vector<size_t> sizes = {1, 10, 100};
+  double min_time = 1;
+  std::string err;
+};
+
+struct Benchmark {
+  std::string name;
+  size_t size;
+  size_t iterations;
+  double mean_ns;
+  double median_ns;
+  double min_ns;
+};
+
+// comma-separated list of store sizes
+bool parseSizes(const std::string& str, std::vector<size_t>& sizes) {
+  std::vector<size_t> parsed;
+  std::istringstream iss(str);
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    if (item.empty() || !std::all_of(item.begin(), item.end(), ::isdigit) || item.size() > 9) {
+      return false;
+    }
+    parsed.push_back(std::stoul(item));
+    if (parsed.back() == 0) {
+      return false;
+    }
+  }
+  if (parsed.empty()) {
+    return false;
+  }
+  sizes = parsed;
+  return true;
+}
+
+Options parseArgs(int argc, char *argv[]) {
+  Options opts;
+
+  int opt;
+  while ((opt = getopt(argc, argv, ":P:S:n:t:hv")) != -1) {
+    switch (opt) {
+      case 'h':
+        opts.help = true;
+        break;
+      case 'P':
+        opts.pk_path = optarg;
+        break;
+      case 'S':
+        opts.sk_path = optarg;
+        break;
+      case 'n':
+        if (!parseSizes(optarg, opts.sizes)) {
+          opts.err = "Invalid sizes: " + std::string(optarg);
+        }
+        break;
+      case 't':
+        opts.min_time = atof(optarg);
+        if (opts.min_time <= 0) {
+          opts.err = "Invalid time: " + std::string(optarg);
+        }
+        break;
+      case 'v':
+        opts.version = true;
+        break;
+      case ':':
+        opts.err = "Bad number of args: '-" + (std::string() + static_cast<char>(optopt)) + "'";
+        break;
+      case '?':
+        opts.err = "Unrecognized option: '-" + (std::string() + static_cast<char>(optopt)) + "'";
+        break;
+    }
+  }
+
+  for (int i = optind; i < argc; i++) {
+    opts.args.push_back(argv[i]);
+  }
+
+  if (!opts.args.empty()) {
+    opts.help = true;
+  }
+
+  return opts;
+}
+
+void showUsage() {
+  std::cerr
+    << "Usage: morph-bench [OPTIONS]" << std::endl
+    << "  -P <filename>      Path to public key (default: morph.pk)" << std::endl
+    << "  -S <filename>      Path to secret key (default: morph.sk)" << std::endl
+    << "  -n <sizes>         Store sizes for get (default: 1,10,100)" << std::endl
+    << "  -t <seconds>       Minimum time per benchmark (default: 1)" << std::endl
+    << "  -h                 Output this help and exit" << std::endl
+    << "  -v                 Output version and exit" << std::endl;
+}
+
+// runs until the minimum time has passed, and at least 3 times
+// setup is called before each run and isn't timed
+Benchmark measure(const std::string& name, size_t size, double min_time, const std::function<void()>& setup, const std::function<void()>& run) {
+  std::cerr << name << (size > 1 ? " (" + std::to_string(size) + ")" : "") << std::endl;
+
+  std::vector<double> times;
+  double total = 0;
+  while (times.size() < 3 || total < min_time * 1e9) {
+    if (setup) {
+      setup();
+    }
+    auto start = std::chrono::steady_clock::now();
+    run();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    times.push_back(ns);
+    total += ns;
+  }
+
+  std::sort(times.begin(), times.end());
+  return {name, size, times.size(), total / times.size(), times[times.size() / 2], times[0]};
+}
+
+std::string toJson(const helib::Context& context, const helib::Ctxt& ctxt, const std::vector<Benchmark>& results) {
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(1)
+    << "{\n"
+    << "  \"version\": \"" << MORPH_VERSION << "\",\n"
+    << "  \"params\": {\n"
+    << "    \"m\": " << context.getM() << ",\n"
+    << "    \"p\": " << context.getP() << ",\n"
+    << "    \"slots\": " << context.getEA().size() << ",\n"
+    << "    \"bit_capacity\": " << ctxt.bitCapacity() << ",\n"
+    << "    \"fingerprint\": \"" << std::hex << morph::contextFingerprint(context) << std::dec << "\"\n"
+    << "  },\n"
+    << "  \"threads\": " << std::thread::hardware_concurrency() << ",\n"
+    << "  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); i++) {
+    const auto& result = results[i];
+    oss << "    {"
+      << "\"name\": \"" << result.name << "\", "
+      << "\"size\": " << result.size << ", "
+      << "\"iterations\": " << result.iterations << ", "
+      << "\"mean_ns\": " << result.mean_ns << ", "
+      << "\"median_ns\": " << result.median_ns << ", "
+      << "\"min_ns\": " << result.min_ns
+      << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  oss << "  ]\n"
+    << "}\n";
+  return oss.str();
+}
+
+void runBenchmarks(const Options& opts) {
+  auto [contextp, pkp] = morph::loadContextAndKey<helib::PubKey>(opts.pk_path, false);
+  morph::Encryptor encryptor(opts.sk_path);
+  const helib::EncryptedArray& ea = contextp->getEA();
+  long p = contextp->getP();
+  double t = opts.min_time;
+
+  auto stringToCtxt = [&](const std::string& str) {
+    std::istringstream iss(str);
+    return helib::Ctxt::readFrom(iss, *pkp);
+  };
+
+  std::string key_str = encryptor.encrypt("+hello");
+  std::string other_str = encryptor.encrypt("+world");
+  std::string value_str = encryptor.encrypt("+value");
+  auto key = stringToCtxt(key_str);
+  auto other = stringToCtxt(other_str);
+  auto value = stringToCtxt(value_str);
+
+  std::vector<Benchmark> results;
+
+  // encryption
+  std::string encrypted, decrypted;
+  results.push_back(measure("encrypt", 1, t, nullptr, [&]() {
+    encrypted = encryptor.encrypt("+value");
+  }));
+  results.push_back(measure("decrypt", 1, t, nullptr, [&]() {
+    decrypted = encryptor.decrypt(value_str);
+  }));
+
+  // serialization
+  std::string serialized;
+  results.push_back(measure("ctxt_to_string", 1, t, nullptr, [&]() {
+    serialized = morph::ctxtToString(value);
+  }));
+  results.push_back(measure("string_to_ctxt", 1, t, nullptr, [&]() {
+    stringToCtxt(value_str);
+  }));
+
+  // each stage of the equality kernel in Store::get, starting from the output of the previous one
+  helib::Ctxt ctxt(*pkp);
+  results.push_back(measure("kernel_subtract", 1, t, [&]() {
+    ctxt = other;
+  }, [&]() {
+    ctxt -= key;
+  }));
+  helib::Ctxt diff = other;
+  diff -= key;
+  results.push_back(measure("kernel_power", 1, t, [&]() {
+    ctxt = diff;
+  }, [&]() {
+    morph::slotsEqual(ctxt, p);
+  }));
+  helib::Ctxt slots = diff;
+  morph::slotsEqual(slots, p);
+  results.push_back(measure("kernel_total_product", 1, t, [&]() {
+    ctxt = slots;
+  }, [&]() {
+    morph::allSlots(ctxt, ea);
+  }));
+  helib::Ctxt mask = slots;
+  morph::allSlots(mask, ea);
+  results.push_back(measure("kernel_multiply", 1, t, [&]() {
+    ctxt = mask;
+  }, [&]() {
+    ctxt.multiplyBy(value);
+  }));
+  helib::Ctxt masked = mask;
+  masked.multiplyBy(value);
+  for (auto size : opts.sizes) {
+    results.push_back(measure("kernel_accumulate", size, t, [&]() {
+      ctxt = masked;
+    }, [&]() {
+      for (size_t i = 1; i < size; i++) {
+        ctxt += masked;
+      }
+    }));
+  }
+
+  // whole get and exists, which scan every entry
+  for (auto size : opts.sizes) {
+    morph::Store store(opts.pk_path);
+    std::vector<std::pair<std::string, std::string>> pairs(size, {other_str, value_str});
+    store.setMany(pairs);
+    results.push_back(measure("store_get", size, t, nullptr, [&]() {
+      store.get(key_str);
+    }));
+    results.push_back(measure("store_exists", size, t, nullptr, [&]() {
+      store.exists({key_str});
+    }));
+  }
+
+  // protocol with ciphertext-sized arguments
+  std::vector<std::string> cmd {"set", key_str, value_str};
+  std::string request = morph::respArray(cmd);
+  results.push_back(measure("resp_array", 1, t, nullptr, [&]() {
+    request = morph::respArray(cmd);
+  }));
+  results.push_back(measure("read_array", 1, t, nullptr, [&]() {
+    morph::readArray(request.c_str());
+  }));
+  results.push_back(measure("read_command", 1, t, nullptr, [&]() {
+    std::vector<std::string> parsed;
+    morph::readCommand(request.data(), request.size(), parsed);
+  }));
+
+  std::cout << toJson(*contextp, key, results);
+}
+
+int main(int argc, char *argv[]) {
+  auto opts = parseArgs(argc, argv);
+
+  if (!opts.err.empty()) {
+    std::cerr << opts.err << std::endl;
+    return 1;
+  } else if (opts.help) {
+    showUsage();
+    return 1;
+  } else if (opts.version) {
+    std::cout << "morph-bench " << MORPH_VERSION << std::endl;
+  } else {
+    runBenchmarks(opts);
+  }
+
+  return 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "client.h"
+#include "network.h"
+#include "parallel.h"
+#include "version.h"
+
+struct Options {
+  std::string hostname = "127.0.0.1";
+  int port = 6774;
+  std::vector<std::string> args;
+  bool help = false;
+  bool version = false;
+  std::string sk_path = "morph.sk";
+  int clients = 4;
+  long requests = 1000;
+  int pipeline = 1;
+  long keyspace = 100;
+  int value_size = 3;
+  // weights of set, get, and mget
+  std::vector<double> mix = {1, 1, 0};
+  int mget_keys = 10;
+  bool pre_encrypted = false;
+  std::string err;
+};
+
+enum COMMAND_TYPE { CMD_SET, CMD_GET, CMD_MGET };
+
+const char* COMMAND_NAMES[] = {"SET", "GET", "MGET"};
+
+struct Command {
+  COMMAND_TYPE type;
+  std::vector<std::string> args;
+};
+
+struct Sample {
+  COMMAND_TYPE type;
+  double usec;
+};
+
+// weights separated by colons, like 1:10:0
+bool parseMix(const std::string& str, std::vector<double>& mix) {
+  std::vector<double> parsed;
+  std::istringstream iss(str);
+  std::string item;
+  while (std::getline(iss, item, ':')) {
+    char* end;
+    double weight = std::strtod(item.c_str(), &end);
+    if (item.empty() || *end != '\0' || weight < 0) {
+      return false;
+    }
+    parsed.push_back(weight);
+  }
+  if (parsed.size() != 3 || parsed[0] + parsed[1] + parsed[2] <= 0) {
+    return false;
+  }
+  mix = parsed;
+  return true;
+}
+
+Options parseArgs(int argc, char *argv[]) {
+  Options opts;
+
+  static struct option long_options[] = {
+    {"pre-encrypted", no_argument, nullptr, 'E'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, ":h:p:S:c:n:P:r:d:m:k:v", long_options, nullptr)) != -1) {
+    switch (opt) {
+      case 'E':
+        opts.pre_encrypted = true;
+        break;
+      case 'h':
+        opts.hostname = optarg;
+        break;
+      case 'p':
+        opts.port = std::atoi(optarg);
+        break;
+      case 'S':
+        opts.sk_path = optarg;
+        break;
+      case 'c':
+        opts.clients = std::atoi(optarg);
+        if (opts.clients < 1) {
+          opts.err = "Invalid clients: " + std::string(optarg);
+        }
+        break;
+      case 'n':
+        opts.requests = std::atol(optarg);
+        if (opts.requests < 1) {
+          opts.err = "Invalid requests: " + std::string(optarg);
+        }
+        break;
+      case 'P':
+        opts.pipeline = std::atoi(optarg);
+        if (opts.pipeline < 1) {
+          opts.err = "Invalid pipeline: " + std::string(optarg);
+        }
+        break;
+      case 'r':
+        opts.keyspace = std::atol(optarg);
+        if (opts.keyspace < 1) {
+          opts.err = "Invalid keyspace: " + std::string(optarg);
+        }
+        break;
+      case 'd':
+        opts.value_size = std::atoi(optarg);
+        if (opts.value_size < 1) {
+          opts.err = "Invalid value size: " + std::string(optarg);
+        }
+        break;
+      case 'm':
+        if (!parseMix(optarg, opts.mix)) {
+          opts.err = "Invalid mix: " + std::string(optarg);
+        }
+        break;
+      case 'k':
+        opts.mget_keys = std::atoi(optarg);
+        if (opts.mget_keys < 1) {
+          opts.err = "Invalid keys per mget: " + std::string(optarg);
+        }
+        break;
+      case 'v':
+        opts.version = true;
+        break;
+      case ':':
+        if (optopt == 'h') {
+          opts.help = true;
+        } else {
+          opts.err = "Bad number of args: '-" + (std::string() + static_cast<char>(optopt)) + "'";
+        }
+        break;
+      case '?':
+        opts.err = "Unrecognized option: '-" + (std::string() + static_cast<char>(optopt)) + "'";
+        break;
+    }
+  }
+
+  for (int i = optind; i < argc; i++) {
+    opts.args.push_back(argv[i]);
+  }
+
+  if (!opts.args.empty()) {
+    opts.help = true;
+  }
+
+  return opts;
+}
+
+void showUsage() {
+  std::cerr
+    << "Usage: morph-benchmark [OPTIONS]" << std::endl
+    << "  -h <hostname>      Server hostname (default: 127.0.0.1)" << std::endl
+    << "  -p <port>          Server port (default: 6774)" << std::endl
+    << "  -S <filename>      Path to secret key (default: morph.sk)" << std::endl
+    << "  -c <clients>       Number of parallel connections (default: 4)" << std::endl
+    << "  -n <requests>      Total number of requests (default: 1000)" << std::endl
+    << "  -P <numreq>        Pipeline <numreq> requests (default: 1)" << std::endl
+    << "  -r <keyspace>      Number of keys, which are set before the run (default: 100)" << std::endl
+    << "  -d <size>          Value size in bytes (default: 3)" << std::endl
+    << "  -m <mix>           Weights of set, get, and mget (default: 1:1:0)" << std::endl
+    << "  -k <keys>          Keys per mget (default: 10)" << std::endl
+    << "  --pre-encrypted    Encrypt requests before the run and skip decrypting replies" << std::endl
+    << "  -h                 Output this help and exit" << std::endl
+    << "  -v                 Output version and exit" << std::endl;
+}
+
+std::string keyName(long i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "key:%012ld", i);
+  return buf;
+}
+
+// the same workload for every run with the same options
+std::vector<Command> generateWorkload(const Options& opts) {
+  std::mt19937 rng(42);
+  std::discrete_distribution<int> type_dist(opts.mix.begin(), opts.mix.end());
+  std::uniform_int_distribution<long> key_dist(0, opts.keyspace - 1);
+  std::string value(opts.value_size, 'x');
+
+  std::vector<Command> workload;
+  workload.reserve(opts.requests);
+  for (long i = 0; i < opts.requests; i++) {
+    auto type = static_cast<COMMAND_TYPE>(type_dist(rng));
+    if (type == CMD_SET) {
+      workload.push_back({type, {"set", keyName(key_dist(rng)), value}});
+    } else if (type == CMD_GET) {
+      workload.push_back({type, {"get", keyName(key_dist(rng))}});
+    } else {
+      std::vector<std::string> args {"mget"};
+      for (int j = 0; j < opts.mget_keys; j++) {
+        args.push_back(keyName(key_dist(rng)));
+      }
+      workload.push_back({type, args});
+    }
+  }
+  return workload;
+}
+
+double percentile(const std::vector<double>& sorted, double q) {
+  size_t index = static_cast<size_t>(std::ceil(q * sorted.size()));
+  return sorted[std::min(std::max<size_t>(index, 1), sorted.size()) - 1];
+}
+
+void printLatency(const std::string& name, std::vector<double> usec) {
+  if (usec.empty()) {
+    return;
+  }
+  std::sort(usec.begin(), usec.end());
+  double sum = 0;
+  for (auto v : usec) {
+    sum += v;
+  }
+  std::cout
+    << std::setw(6) << name
+    << std::setw(10) << usec.size()
+    << std::setw(10) << sum / usec.size() / 1000
+    << std::setw(10) << usec.front() / 1000
+    << std::setw(10) << percentile(usec, 0.5) / 1000
+    << std::setw(10) << percentile(usec, 0.99) / 1000
+    << std::setw(10) << percentile(usec, 0.999) / 1000
+    << std::setw(10) << usec.back() / 1000
+    << std::endl;
+}
+
+void runBenchmark(Options& opts) {
+  morph::ClientOptions client_options;
+  client_options.hostname = opts.hostname;
+  client_options.port = opts.port;
+  client_options.sk_path = opts.sk_path;
+  morph::Client client(client_options);
+
+  // also loads the key before starting threads
+  try {
+    client.encode({"set", keyName(0), std::string(opts.value_size, 'x')});
+  } catch (const std::exception& e) {
+    std::cerr << "Value size is too large for the encryption parameters" << std::endl;
+    exit(1);
+  }
+
+  auto workload = generateWorkload(opts);
+
+  std::vector<std::string> encoded;
+  if (opts.pre_encrypted) {
+    std::cerr << "Encrypting " << workload.size() << " requests..." << std::endl;
+    encoded.resize(workload.size());
+    morph::parallelFor(workload.size(), [&](size_t i) {
+      encoded[i] = client.encode(workload[i].args);
+    });
+  }
+
+  std::cerr << "Setting " << opts.keyspace << " keys..." << std::endl;
+  std::string value(opts.value_size, 'x');
+  for (long start = 0; start < opts.keyspace; start += 100) {
+    std::vector<std::pair<std::string, std::string>> pairs;
+    for (long i = start; i < std::min(start + 100, opts.keyspace); i++) {
+      pairs.emplace_back(keyName(i), value);
+    }
+    if (!client.mset(pairs)) {
+      std::cerr << "Can't set keys" << std::endl;
+      exit(1);
+    }
+  }
+
+  std::cerr << "Running..." << std::endl;
+
+  std::atomic<size_t> next(0);
+  std::atomic<long> errors(0);
+  std::vector<std::vector<Sample>> samples(opts.clients);
+  std::vector<std::thread> threads;
+
+  // timing starts once every client is connected and has loaded the key
+  std::mutex ready_mutex;
+  std::condition_variable ready_cv;
+  int ready = 0;
+  bool go = false;
+
+  for (int c = 0; c < opts.clients; c++) {
+    threads.emplace_back([&, c]() {
+      auto& thread_samples = samples[c];
+      std::unique_ptr<morph::Client> thread_client;
+      int connection = -1;
+      std::string buffer, reply;
+      if (opts.pre_encrypted) {
+        connection = morph::connOpen(opts.hostname.c_str(), opts.port);
+      } else {
+        thread_client = std::make_unique<morph::Client>(client_options);
+        // loads the key and connects
+        try {
+          thread_client->dbsize();
+        } catch (const std::runtime_error& e) {
+          std::cerr << e.what() << std::endl;
+          exit(1);
+        }
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(ready_mutex);
+        ready++;
+        ready_cv.notify_all();
+        ready_cv.wait(lock, [&] { return go; });
+      }
+
+      while (true) {
+        size_t first = next.fetch_add(opts.pipeline);
+        if (first >= workload.size()) {
+          break;
+        }
+        size_t last = std::min(first + opts.pipeline, workload.size());
+        auto batch_start = std::chrono::steady_clock::now();
+
+        if (opts.pre_encrypted) {
+          std::string batch;
+          for (size_t i = first; i < last; i++) {
+            batch += encoded[i];
+          }
+          if (!morph::connWrite(connection, batch)) {
+            std::cerr << "Error writing to server" << std::endl;
+            exit(1);
+          }
+          // each reply is timed from when its batch was sent
+          for (size_t i = first; i < last; i++) {
+            if (!morph::connReadReply(connection, buffer, reply)) {
+              std::cerr << "Error reading from server" << std::endl;
+              exit(1);
+            }
+            double usec = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - batch_start).count();
+            thread_samples.push_back({workload[i].type, usec});
+            if (reply[0] == '-') {
+              errors++;
+            }
+          }
+        } else {
+          // includes encrypting requests and decrypting replies
+          std::vector<std::vector<std::string>> cmds;
+          for (size_t i = first; i < last; i++) {
+            cmds.push_back(workload[i].args);
+          }
+          std::vector<morph::Result> results;
+          try {
+            results = thread_client->pipeline(cmds);
+          } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            exit(1);
+          }
+          double usec = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - batch_start).count();
+          for (size_t i = first; i < last; i++) {
+            thread_samples.push_back({workload[i].type, usec});
+            if (results[i - first].type == morph::RESP_ERROR) {
+              errors++;
+            }
+          }
+        }
+      }
+
+      if (connection != -1) {
+        close(connection);
+      }
+    });
+  }
+
+  std::chrono::steady_clock::time_point start;
+  {
+    std::unique_lock<std::mutex> lock(ready_mutex);
+    ready_cv.wait(lock, [&] { return ready == opts.clients; });
+    start = std::chrono::steady_clock::now();
+    go = true;
+  }
+  ready_cv.notify_all();
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  std::vector<std::vector<double>> by_type(3);
+  for (const auto& thread_samples : samples) {
+    for (const auto& sample : thread_samples) {
+      all.push_back(sample.usec);
+      by_type[sample.type].push_back(sample.usec);
+    }
+  }
+
+  std::cout << std::fixed << std::setprecision(3)
+    << "====== morph-benchmark ======" << std::endl
+    << "  " << all.size() << " requests completed in " << seconds << " seconds" << std::endl
+    << "  " << opts.clients << " parallel clients" << std::endl
+    << "  pipeline depth " << opts.pipeline << std::endl
+    << "  " << opts.keyspace << " keys, " << opts.value_size << " byte values" << std::endl
+    << "  client-side encryption " << (opts.pre_encrypted ? "excluded" : "included") << std::endl
+    << "  " << errors << " errors" << std::endl
+    << std::endl
+    << std::setprecision(2)
+    << "throughput summary: " << all.size() / seconds << " requests per second" << std::endl
+    << std::setprecision(3)
+    << "latency summary (msec):" << std::endl
+    << std::setw(6) << ""
+    << std::setw(10) << "count"
+    << std::setw(10) << "avg"
+    << std::setw(10) << "min"
+    << std::setw(10) << "p50"
+    << std::setw(10) << "p99"
+    << std::setw(10) << "p999"
+    << std::setw(10) << "max"
+    << std::endl;
+  for (int i = 0; i < 3; i++) {
+    printLatency(COMMAND_NAMES[i], by_type[i]);
+  }
+  printLatency("ALL", all);
+}
+
+int main(int argc, char *argv[]) {
+  auto opts = parseArgs(argc, argv);
+
+  if (!opts.err.empty()) {
+    std::cerr << opts.err << std::endl;
+    return 1;
+  } else if (opts.help) {
+    showUsage();
+    return 1;
+  } else if (opts.version) {
+    std::cout << "morph-benchmark " << MORPH_VERSION << std::endl;
+  } else {
+    try {
+      runBenchmark(opts);
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
+    }
+  }
+
+  return 0;
+}
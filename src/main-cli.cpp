@@ -14,44 +14,86 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <chrono>
+#include <fstream>
+#include <getopt.h>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 #include <unistd.h>
 #include <vector>
 
 #include "client.h"
+#include "network.h"
 #include "version.h"
 
 struct Options {
   std::string hostname = "127.0.0.1";
   int port = 6774;
   std::vector<std::string> args;
+  std::vector<std::pair<std::string, int>> servers;
   bool help = false;
   bool version = false;
+  bool interactive = false;
+  bool pipe = false;
+  int pipe_batch = 256;
   std::string sk_path = "morph.sk";
+  long buckets = 0;
   std::string err;
 };
 
 Options parseArgs(int argc, char *argv[]) {
   Options opts;
 
+  static struct option long_options[] = {
+    {"pipe", no_argument, nullptr, 'P'},
+    {"pipe-batch", required_argument, nullptr, 'B'},
+    {"buckets", required_argument, nullptr, 'K'},
+    {nullptr, 0, nullptr, 0}
+  };
+
   int opt;
-  while ((opt = getopt(argc, argv, ":h:p:S:v")) != -1) {
+  while ((opt = getopt_long(argc, argv, ":h:p:s:S:iv", long_options, nullptr)) != -1) {
     switch (opt) {
+      case 'P':
+        opts.pipe = true;
+        break;
+      case 'B':
+        opts.pipe_batch = std::atoi(optarg);
+        if (opts.pipe_batch < 1) {
+          opts.err = "Invalid batch size: " + std::string(optarg);
+        }
+        break;
+      case 'K':
+        opts.buckets = std::atol(optarg);
+        if (opts.buckets < 1 || opts.buckets > 65536) {
+          opts.err = "Invalid number of buckets: " + std::string(optarg);
+        }
+        break;
       case 'h':
         opts.hostname = optarg;
         break;
       case 'p':
         opts.port = std::atoi(optarg);
         break;
+      case 's':
+        if (!morph::parseServers(optarg, opts.servers)) {
+          opts.err = "Invalid servers: " + std::string(optarg);
+        }
+        break;
       case 'S':
         opts.sk_path = optarg;
         break;
+      case 'i':
+        opts.interactive = true;
+        break;
       case 'v':
         opts.version = true;
         break;
       case ':':
-        if (optopt != 'h') {
+        if (optopt == 'h') {
+          opts.help = true;
+        } else {
           opts.err = "Bad number of args: '-" + (std::string() + static_cast<char>(optopt)) + "'";
         }
         break;
@@ -61,8 +103,8 @@ Options parseArgs(int argc, char *argv[]) {
     }
   }
 
-  if (optind >= argc) {
-    opts.help = true;
+  if (optind >= argc && !opts.pipe) {
+    opts.interactive = true;
   }
 
   for (int i = optind; i < argc; i++) {
@@ -77,13 +119,20 @@ void showUsage() {
     << "Usage: morph-cli [OPTIONS] [cmd [arg [arg ...]]]" << std::endl
     << "  -h <hostname>      Server hostname (default: 127.0.0.1)" << std::endl
     << "  -p <port>          Server port (default: 6774)" << std::endl
+    << "  -s <servers>       Shard keys across servers, like host1:6774,host2:6774" << std::endl
     << "  -S <filename>      Path to secret key (default: morph.sk)" << std::endl
+    << "  -i                 Interactive mode (default when no command is given)" << std::endl
+    << "  --pipe [filename]  Mass insertion from stdin or a file" << std::endl
+    << "  --pipe-batch <n>   Commands per pipelined batch (default: 256)" << std::endl
+    << "  --buckets <n>      Enable the bucketed index with keygen (leaks bucket membership)" << std::endl
     << "  -h                 Output this help and exit" << std::endl
     << "  -v                 Output version and exit" << std::endl << std::endl
     << "Examples:" << std::endl
     << "  morph-cli keygen" << std::endl
     << "  morph-cli set hello world" << std::endl
-    << "  morph-cli get hello" << std::endl;
+    << "  morph-cli get hello" << std::endl
+    << "  morph-cli" << std::endl
+    << "  morph-cli --pipe data.txt" << std::endl;
 }
 
 // TODO accept std::optional<std::string>
@@ -107,6 +156,245 @@ void printArray(std::vector<std::string> arr) {
   }
 }
 
+// for replies with integers and nested arrays
+void printElements(const std::vector<morph::Result>& elements, size_t indent) {
+  if (elements.empty()) {
+    std::cout << "(empty list or set)" << std::endl;
+    return;
+  }
+  for (size_t i = 0; i < elements.size(); i++) {
+    std::string prefix = std::to_string(i + 1) + ") ";
+    std::cout << (i > 0 ? std::string(indent, ' ') : "") << prefix;
+    const auto& element = elements[i];
+    if (element.type == morph::RESP_ARRAY) {
+      printElements(element.elements, indent + prefix.size());
+    } else if (element.type == morph::RESP_INTEGER) {
+      std::cout << element.value_int << std::endl;
+    } else {
+      std::cout << inspectString(element.value_str) << std::endl;
+    }
+  }
+}
+
+int printResult(const std::vector<std::string>& args, const morph::Result& res) {
+  switch(res.type) {
+    case morph::RESP_SIMPLE_STRING:
+      std::cout << res.value_str << std::endl;
+      break;
+    case morph::RESP_ERROR:
+      std::cout << "(error) " << res.value_str << std::endl;
+      return 1;
+    case morph::RESP_INTEGER:
+      std::cout << std::to_string(res.value_int) << std::endl;
+      break;
+    case morph::RESP_BULK_STRING:
+      if (args[0] == "info" || args[0] == "debug") {
+        std::cout << res.value_str;
+      } else {
+        std::cout << inspectString(res.value_str) << std::endl;
+      }
+      break;
+    case morph::RESP_ARRAY:
+      if (args[0] == "latency" || args[0] == "slowlog" || args[0] == "debug" || args[0] == "scan" || args[0] == "command") {
+        printElements(res.elements, 0);
+      } else {
+        printArray(res.value_arr);
+      }
+      break;
+    case morph::RESP_UNKNOWN:
+      std::cout << "(error) Unknown response" << std::endl;
+      return -1;
+  }
+  return 0;
+}
+
+// splits a line like redis-cli, with support for quoted arguments
+bool splitArgs(const std::string& line, std::vector<std::string>& args) {
+  size_t i = 0;
+  while (true) {
+    while (i < line.size() && isspace(line[i])) {
+      i++;
+    }
+    if (i == line.size()) {
+      return true;
+    }
+
+    std::string arg;
+    char quote = 0;
+    while (i < line.size()) {
+      char c = line[i];
+      if (quote == '"' && c == '\\' && i + 1 < line.size()) {
+        char next = line[++i];
+        switch (next) {
+          case 'n': arg.push_back('\n'); break;
+          case 'r': arg.push_back('\r'); break;
+          case 't': arg.push_back('\t'); break;
+          default: arg.push_back(next);
+        }
+      } else if (quote == '\'' && c == '\\' && i + 1 < line.size() && line[i + 1] == '\'') {
+        arg.push_back(line[++i]);
+      } else if (quote != 0 && c == quote) {
+        quote = 0;
+        // closing quote must be followed by a space
+        if (i + 1 < line.size() && !isspace(line[i + 1])) {
+          return false;
+        }
+      } else if (quote == 0 && (c == '"' || c == '\'')) {
+        quote = c;
+      } else if (quote == 0 && isspace(c)) {
+        break;
+      } else {
+        arg.push_back(c);
+      }
+      i++;
+    }
+    if (quote != 0) {
+      return false;
+    }
+    args.push_back(arg);
+  }
+}
+
+int repl(morph::Client& morph, const Options& opts) {
+  bool tty = isatty(STDIN_FILENO);
+  std::string prompt = opts.hostname + ":" + std::to_string(opts.port) + "> ";
+
+  std::string line;
+  while (true) {
+    if (tty) {
+      std::cout << prompt << std::flush;
+    }
+    if (!std::getline(std::cin, line)) {
+      break;
+    }
+
+    std::vector<std::string> args;
+    if (!splitArgs(line, args)) {
+      std::cout << "Invalid argument(s)" << std::endl;
+      continue;
+    }
+    if (args.empty()) {
+      continue;
+    }
+
+    for (auto &c : args[0]) {
+      c = tolower(c);
+    }
+    if (args[0] == "quit" || args[0] == "exit") {
+      break;
+    }
+    if (args[0] == "keygen") {
+      std::cout << "(error) keygen is not supported in interactive mode" << std::endl;
+      continue;
+    }
+
+    // reconnects on the next command
+    try {
+      printResult(args, morph.execute(args));
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+  if (tty) {
+    std::cout << std::endl;
+  }
+  return 0;
+}
+
+// lines are commands, or key and value separated by a tab
+bool parsePipeLine(const std::string& line, std::vector<std::string>& args) {
+  auto tab = line.find('\t');
+  if (tab != std::string::npos) {
+    args = {"set", line.substr(0, tab), line.substr(tab + 1)};
+    return true;
+  }
+  if (!splitArgs(line, args)) {
+    return false;
+  }
+  if (!args.empty()) {
+    for (auto &c : args[0]) {
+      c = tolower(c);
+    }
+  }
+  return true;
+}
+
+int pipeMode(morph::Client& morph, const Options& opts) {
+  std::ifstream file;
+  if (!opts.args.empty()) {
+    if (opts.args.size() > 1) {
+      std::cerr << "Too many arguments" << std::endl;
+      return 1;
+    }
+    file.open(opts.args[0]);
+    if (!file.is_open()) {
+      std::cerr << "Error opening file: " << opts.args[0] << std::endl;
+      return 1;
+    }
+  }
+  std::istream& input = opts.args.empty() ? std::cin : file;
+
+  auto start = std::chrono::steady_clock::now();
+  long replies = 0;
+  long errors = 0;
+  long line_number = 0;
+
+  // only one batch is in memory at a time
+  std::vector<std::vector<std::string>> batch;
+  std::vector<long> batch_lines;
+  std::string line;
+  bool done = false;
+  while (!done) {
+    batch.clear();
+    batch_lines.clear();
+    while (batch.size() < opts.pipe_batch) {
+      if (!std::getline(input, line)) {
+        done = true;
+        break;
+      }
+      line_number++;
+
+      std::vector<std::string> args;
+      if (!parsePipeLine(line, args)) {
+        std::cerr << "Line " << line_number << ": Invalid argument(s)" << std::endl;
+        errors++;
+        continue;
+      }
+      if (args.empty()) {
+        continue;
+      }
+      batch.push_back(std::move(args));
+      batch_lines.push_back(line_number);
+    }
+    if (batch.empty()) {
+      continue;
+    }
+
+    std::vector<morph::Result> results;
+    try {
+      results = morph.pipeline(batch);
+    } catch (const std::runtime_error& e) {
+      // earlier commands in the batch may have been applied
+      std::cerr << "Lines " << batch_lines.front() << "-" << batch_lines.back() << ": " << e.what() << std::endl;
+      return 1;
+    }
+    for (int i = 0; i < results.size(); i++) {
+      replies++;
+      if (results[i].type == morph::RESP_ERROR) {
+        std::cerr << "Line " << batch_lines[i] << ": (error) " << results[i].value_str << std::endl;
+        errors++;
+      }
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "errors: " << errors << ", replies: " << replies << std::endl;
+  std::cout << replies << " commands in " << seconds << " seconds ("
+    << (seconds > 0 ? replies / seconds : 0) << " commands/sec)" << std::endl;
+  return errors > 0 ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
   auto opts = parseArgs(argc, argv);
 
@@ -118,45 +406,32 @@ int main(int argc, char *argv[]) {
     return 1;
   } else if (opts.version) {
     std::cout << "morph-cli " << MORPH_VERSION << std::endl;
-  } else if (opts.args[0] == "keygen") {
+  } else if (!opts.interactive && !opts.pipe && opts.args[0] == "keygen") {
     if (opts.args.size() > 1) {
       std::cerr << "Too many arguments" << std::endl;
       return 1;
     }
     auto morph = morph::Client();
-    morph.keygen();
+    morph.keygen(opts.buckets);
     std::cerr << "Generated morph.sk (secret key) and morph.pk (public key)" << std::endl;
   } else {
     auto options = morph::ClientOptions();
     options.hostname = opts.hostname;
     options.port = opts.port;
     options.sk_path = opts.sk_path;
+    options.servers = opts.servers;
     auto morph = morph::Client(options);
-    auto res = morph.execute(opts.args);
-
-    switch(res.type) {
-      case morph::RESP_SIMPLE_STRING:
-        std::cout << res.value_str << std::endl;
-        break;
-      case morph::RESP_ERROR:
-        std::cout << "(error) " << res.value_str << std::endl;
-        return 1;
-      case morph::RESP_INTEGER:
-        std::cout << std::to_string(res.value_int) << std::endl;
-        break;
-      case morph::RESP_BULK_STRING:
-        if (opts.args[0] == "info") {
-          std::cout << res.value_str;
-        } else {
-          std::cout << inspectString(res.value_str) << std::endl;
-        }
-        break;
-      case morph::RESP_ARRAY:
-        printArray(res.value_arr);
-        break;
-      case morph::RESP_UNKNOWN:
-        std::cout << "(error) Unknown response" << std::endl;
-        return -1;
+    if (opts.pipe) {
+      return pipeMode(morph, opts);
+    }
+    if (opts.interactive) {
+      return repl(morph, opts);
+    }
+    try {
+      return printResult(opts.args, morph.execute(opts.args));
+    } catch (const std::runtime_error& e) {
+      std::cerr << e.what() << std::endl;
+      return 1;
     }
   }
 
@@ -14,11 +14,15 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <cctype>
+#include <cstdint>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <unistd.h>
 #include <vector>
 
+#include "network.h"
 #include "server.h"
 #include "version.h"
 
@@ -29,14 +33,71 @@ struct Options {
   bool help = false;
   bool version = false;
   std::string pk_path = "morph.pk";
+  std::string snapshot_path = "dump.morph";
+  bool appendonly = false;
+  std::string aof_path = "appendonly.morph";
+  morph::FSYNC_POLICY appendfsync = morph::FSYNC_EVERYSEC;
+  std::vector<std::pair<int, int>> save_params = {{3600, 1}, {300, 100}, {60, 10000}};
+  std::string master_host;
+  int master_port = 0;
+  long slowlog_log_slower_than = 10000;
+  long slowlog_max_len = 128;
+  long databases = 16;
+  bool he_timers = false;
+  bool compact = false;
+  uint64_t maxmemory = 0;
+  bool warmup = false;
   std::string err;
 };
 
+// pairs of seconds and changes, like "3600 1 300 100"
+bool parseSaveParams(const std::string& str, std::vector<std::pair<int, int>>& params) {
+  std::istringstream iss(str);
+  std::vector<std::pair<int, int>> parsed;
+  int seconds, changes;
+  while (iss >> seconds) {
+    if (!(iss >> changes) || seconds < 1 || changes < 1) {
+      return false;
+    }
+    parsed.emplace_back(seconds, changes);
+  }
+  if (!iss.eof()) {
+    return false;
+  }
+  params = parsed;
+  return true;
+}
+
+// bytes with an optional unit like Redis, where 1k is 1000 and 1kb is 1024
+bool parseMemory(const std::string& str, uint64_t& bytes) {
+  size_t pos = 0;
+  while (pos < str.size() && isdigit(str[pos])) {
+    pos++;
+  }
+  if (pos == 0 || pos > 18) {
+    return false;
+  }
+  std::string unit = str.substr(pos);
+  for (auto &c : unit) {
+    c = tolower(c);
+  }
+  const std::vector<std::pair<std::string, uint64_t>> units = {
+    {"", 1}, {"k", 1000}, {"kb", 1024}, {"m", 1000 * 1000}, {"mb", 1024 * 1024}, {"g", 1000 * 1000 * 1000}, {"gb", 1024 * 1024 * 1024}
+  };
+  for (const auto& u : units) {
+    if (unit == u.first) {
+      bytes = std::stoull(str.substr(0, pos)) * u.second;
+      return true;
+    }
+  }
+  return false;
+}
+
 Options parseArgs(int argc, char *argv[]) {
   Options opts;
 
   int opt;
-  while ((opt = getopt(argc, argv, ":p:b:P:hv")) != -1) {
+  while ((opt = getopt(argc, argv, ":p:b:P:d:s:aA:f:r:l:L:D:m:cwThv")) != -1) {
     switch (opt) {
       case 'h':
         opts.help = true;
@@ -50,6 +111,71 @@ Options parseArgs(int argc, char *argv[]) {
       case 'P':
         opts.pk_path = optarg;
         break;
+      case 'd':
+        opts.snapshot_path = optarg;
+        break;
+      case 's':
+        if (!parseSaveParams(optarg, opts.save_params)) {
+          opts.err = "Invalid save policy: " + std::string(optarg);
+        }
+        break;
+      case 'a':
+        opts.appendonly = true;
+        break;
+      case 'A':
+        opts.aof_path = optarg;
+        break;
+      case 'f':
+        if (std::string(optarg) == "always") {
+          opts.appendfsync = morph::FSYNC_ALWAYS;
+        } else if (std::string(optarg) == "everysec") {
+          opts.appendfsync = morph::FSYNC_EVERYSEC;
+        } else if (std::string(optarg) == "no") {
+          opts.appendfsync = morph::FSYNC_NO;
+        } else {
+          opts.err = "Invalid fsync policy: " + std::string(optarg);
+        }
+        break;
+      case 'r':
+        {
+          std::vector<std::pair<std::string, int>> servers;
+          if (!morph::parseServers(optarg, servers) || servers.size() != 1) {
+            opts.err = "Invalid master: " + std::string(optarg);
+          } else {
+            opts.master_host = servers[0].first;
+            opts.master_port = servers[0].second;
+          }
+        }
+        break;
+      case 'l':
+        opts.slowlog_log_slower_than = atol(optarg);
+        break;
+      case 'L':
+        opts.slowlog_max_len = atol(optarg);
+        if (opts.slowlog_max_len < 0) {
+          opts.err = "Invalid slow log length: " + std::string(optarg);
+        }
+        break;
+      case 'D':
+        opts.databases = atol(optarg);
+        if (opts.databases < 1) {
+          opts.err = "Invalid number of databases: " + std::string(optarg);
+        }
+        break;
+      case 'm':
+        if (!parseMemory(optarg, opts.maxmemory)) {
+          opts.err = "Invalid maxmemory: " + std::string(optarg);
+        }
+        break;
+      case 'c':
+        opts.compact = true;
+        break;
+      case 'w':
+        opts.warmup = true;
+        break;
+      case 'T':
+        opts.he_timers = true;
+        break;
       case 'v':
         opts.version = true;
         break;
@@ -79,6 +205,19 @@ void showUsage() {
     << "  -p <port>          Port (default: 6774)" << std::endl
     << "  -b <address>       Bind address (default: 127.0.0.1)" << std::endl
     << "  -P <filename>      Path to public key (default: morph.pk)" << std::endl
+    << "  -d <filename>      Path to snapshot (default: dump.morph)" << std::endl
+    << "  -s <policy>        Save after seconds and changes (default: \"3600 1 300 100 60 10000\")" << std::endl
+    << "  -a                 Enable append only file" << std::endl
+    << "  -A <filename>      Path to append only file (default: appendonly.morph)" << std::endl
+    << "  -f <policy>        Fsync policy: always, everysec, or no (default: everysec)" << std::endl
+    << "  -r <host:port>     Replicate from a master" << std::endl
+    << "  -l <usec>          Log commands slower than this, or -1 to disable (default: 10000)" << std::endl
+    << "  -L <entries>       Maximum length of slow log (default: 128)" << std::endl
+    << "  -D <count>         Number of databases (default: 16)" << std::endl
+    << "  -m <bytes>         Reject writes when entries use more memory, like 4gb (default: no limit)" << std::endl
+    << "  -c                 Store entries serialized to reduce allocations (slower gets)" << std::endl
+    << "  -w                 Run a query before accepting connections" << std::endl
+    << "  -T                 Enable HElib timers" << std::endl
     << "  -h                 Output this help and exit" << std::endl
     << "  -v                 Output version and exit" << std::endl;
 }
@@ -99,6 +238,20 @@ int main(int argc, char *argv[]) {
     options.bind = opts.bind;
     options.port = opts.port;
     options.pk_path = opts.pk_path;
+    options.snapshot_path = opts.snapshot_path;
+    options.save_params = opts.save_params;
+    options.appendonly = opts.appendonly;
+    options.aof_path = opts.aof_path;
+    options.appendfsync = opts.appendfsync;
+    options.master_host = opts.master_host;
+    options.master_port = opts.master_port;
+    options.slowlog_log_slower_than = opts.slowlog_log_slower_than;
+    options.slowlog_max_len = opts.slowlog_max_len;
+    options.databases = opts.databases;
+    options.he_timers = opts.he_timers;
+    options.compact = opts.compact;
+    options.maxmemory = opts.maxmemory;
+    options.warmup = opts.warmup;
     auto server = morph::Server(options);
     server.start();
   }
@@ -15,20 +15,26 @@
  */
 
 #include <arpa/inet.h>
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "network.h"
+#include "resp.h"
 
 namespace morph {
 
-int connSend(char const *hostname, int port, const std::string& oss) {
+// without waiting for the connection when nonblocking
+int connectSocket(char const *hostname, int port, std::string& message, bool nonblocking) {
   int sd = -1, err;
   struct addrinfo hints = {}, *addrs;
   char port_str[16] = {};
@@ -41,8 +47,8 @@ int connSend(char const *hostname, int port, const std::string& oss) {
 
   err = getaddrinfo(hostname, port_str, &hints, &addrs);
   if (err != 0) {
-    fprintf(stderr, "Could not connect to Morph at %s:%d: %s\n", hostname, port, std::strerror(err));
-    exit(1);
+    message = gai_strerror(err);
+    return -1;
   }
 
   for (struct addrinfo *addr = addrs; addr != NULL; addr = addr->ai_next) {
@@ -52,7 +58,10 @@ int connSend(char const *hostname, int port, const std::string& oss) {
       break;
     }
 
-    if (connect(sd, addr->ai_addr, addr->ai_addrlen) == 0) {
+    if (nonblocking) {
+      setNonBlocking(sd);
+    }
+    if (connect(sd, addr->ai_addr, addr->ai_addrlen) == 0 || (nonblocking && errno == EINPROGRESS)) {
       break;
     }
 
@@ -65,31 +74,243 @@ int connSend(char const *hostname, int port, const std::string& oss) {
   freeaddrinfo(addrs);
 
   if (sd == -1) {
-    fprintf(stderr, "Could not connect to Morph at %s:%d: %s\n", hostname, port, std::strerror(err));
+    message = std::strerror(err);
+  }
+  return sd;
+}
+
+int connTryOpen(char const *hostname, int port, std::string& message) {
+  return connectSocket(hostname, port, message, false);
+}
+
+int connStartOpen(char const *hostname, int port, std::string& message) {
+  return connectSocket(hostname, port, message, true);
+}
+
+bool connFinishOpen(int fd, std::string& message) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) {
+    err = errno;
+  }
+  if (err != 0) {
+    message = std::strerror(err);
+    return false;
+  }
+  return true;
+}
+
+int connOpen(char const *hostname, int port) {
+  std::string message;
+  int sd = connTryOpen(hostname, port, message);
+  if (sd == -1) {
+    fprintf(stderr, "Could not connect to Morph at %s:%d: %s\n", hostname, port, message.c_str());
     exit(1);
   }
+  return sd;
+}
 
-  send(sd, oss.c_str(), oss.size(), 0);
+int connSend(char const *hostname, int port, const std::string& oss) {
+  int sd = connOpen(hostname, port);
+  connWrite(sd, oss);
   return sd;
 }
 
-// TODO remove this hack and read data properly
-int connRead(int connection, char* buffer, int buffer_size) {
-  auto bytesRead = read(connection, buffer, buffer_size);
-  auto result = bytesRead;
-  while (result > 0 && bytesRead < buffer_size && buffer[bytesRead - 2] != '\r' && buffer[bytesRead - 1] != '\n') {
-    result = read(connection, buffer + bytesRead, buffer_size - bytesRead);
-    if (result < 1) {
-      return -1;
+bool connWrite(int connection, const std::string& data) {
+#ifdef MSG_NOSIGNAL
+  int flags = MSG_NOSIGNAL;
+#else
+  int flags = 0;
+#endif
+
+  size_t written = 0;
+  while (written < data.size()) {
+    auto result = send(connection, data.data() + written, data.size() - written, flags);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      return false;
+    }
+    written += result;
+  }
+  return true;
+}
+
+// buffer keeps any bytes read past the reply for the next call
+bool connReadReply(int connection, std::string& buffer, std::string& reply) {
+  char chunk[65536];
+  while (true) {
+    auto len = replyLength(buffer.data(), buffer.size());
+    if (len < 0) {
+      return false;
     }
-    bytesRead += result;
+    if (len > 0) {
+      reply = buffer.substr(0, len);
+      buffer.erase(0, len);
+      return true;
+    }
+
+    auto bytesRead = read(connection, chunk, sizeof(chunk));
+    if (bytesRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytesRead <= 0) {
+      return false;
+    }
+    buffer.append(chunk, bytesRead);
+  }
+}
+
+int connListen(char const *bind, int port, std::string& section) {
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd == -1) {
+    section = "socket";
+    return -1;
+  }
+
+  int v = 1;
+  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(int)) == -1) {
+    section = "setsockopt";
+    return -1;
   }
 
-  if (buffer[bytesRead - 2] != '\r' && buffer[bytesRead - 1] != '\n') {
-    return -2;
+  sockaddr_in sockaddr = {};
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_addr.s_addr = inet_addr(bind);
+  sockaddr.sin_port = htons(port);
+  if (::bind(sockfd, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
+    section = "bind";
+    return -1;
   }
 
-  return bytesRead;
+  int max_connections = 10;
+  if (listen(sockfd, max_connections) < 0) {
+    section = "listen";
+    return -1;
+  }
+  setNonBlocking(sockfd);
+
+  return sockfd;
+}
+
+int connAccept(int sockfd) {
+  sockaddr_in sockaddr;
+  auto addrlen = sizeof(sockaddr);
+  int connection = accept(sockfd, (struct sockaddr*)&sockaddr, (socklen_t*)&addrlen);
+  if (connection < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+      return -2;
+    }
+    return -1;
+  }
+  setNonBlocking(connection);
+  return connection;
+}
+
+void setNonBlocking(int fd) {
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+size_t readCommands(Connection& conn, const std::function<std::string(std::vector<std::string>&)>& process) {
+  char buffer[65536];
+  size_t total = 0;
+  while (true) {
+    auto bytesRead = read(conn.fd, buffer, sizeof(buffer));
+    if (bytesRead > 0) {
+      conn.input.append(buffer, bytesRead);
+      total += bytesRead;
+    } else if (bytesRead < 0 && errno == EINTR) {
+      continue;
+    } else {
+      if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        conn.closing = true;
+      }
+      break;
+    }
+  }
+
+  // process every complete command to support pipelining
+  size_t pos = 0;
+  while (pos < conn.input.size()) {
+    std::vector<std::string> cmd;
+    auto len = readCommand(conn.input.data() + pos, conn.input.size() - pos, cmd);
+    if (len == 0) {
+      break;
+    }
+    if (len < 0) {
+      conn.output += respError("ERR Protocol error");
+      conn.input.clear();
+      conn.closing = true;
+      return total;
+    }
+    pos += len;
+    if (!cmd.empty()) {
+      conn.output += process(cmd);
+    }
+  }
+  conn.input.erase(0, pos);
+
+  // same as Redis proto-max-bulk-len
+  if (conn.input.size() > 536870912) {
+    conn.output += respError("ERR Protocol error: request too large");
+    conn.input.clear();
+    conn.closing = true;
+  }
+  return total;
+}
+
+size_t writeConnection(Connection& conn) {
+  size_t total = 0;
+  while (!conn.output.empty()) {
+    auto written = write(conn.fd, conn.output.data(), conn.output.size());
+    if (written > 0) {
+      conn.output.erase(0, written);
+      total += written;
+    } else if (written < 0 && errno == EINTR) {
+      continue;
+    } else {
+      if (written == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        conn.output.clear();
+        conn.closing = true;
+      }
+      break;
+    }
+  }
+  return total;
+}
+
+std::string connPeer(int fd) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  char ip[INET_ADDRSTRLEN];
+  if (getpeername(fd, reinterpret_cast<struct sockaddr*>(&addr), &len) != 0
+      || inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)) == nullptr) {
+    return "?:0";
+  }
+  return std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+bool parseServers(const std::string& str, std::vector<std::pair<std::string, int>>& servers) {
+  size_t start = 0;
+  while (start <= str.size()) {
+    auto end = str.find(',', start);
+    if (end == std::string::npos) {
+      end = str.size();
+    }
+    auto server = str.substr(start, end - start);
+    auto colon = server.rfind(':');
+    if (colon == std::string::npos || colon == 0) {
+      return false;
+    }
+    int port = std::atoi(server.c_str() + colon + 1);
+    if (port <= 0) {
+      return false;
+    }
+    servers.emplace_back(server.substr(0, colon), port);
+    start = end + 1;
+  }
+  return true;
 }
 
 } // namespace morph
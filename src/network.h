@@ -16,11 +16,50 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace morph {
 
+// server side of a client connection
+struct Connection {
+  Connection(int fd) : fd(fd) {}
+
+  int fd;
+  std::string input;
+  std::string output;
+  bool closing = false;
+  // selected database
+  size_t db = 0;
+};
+
+// returns -1 with the error in err instead of exiting
+int connTryOpen(char const *hostname, int port, std::string& err);
+// returns a non-blocking socket that may still be connecting, or -1 with the error in err
+// once it's writable, connFinishOpen returns whether the connection succeeded
+int connStartOpen(char const *hostname, int port, std::string& err);
+bool connFinishOpen(int fd, std::string& err);
+int connOpen(char const *hostname, int port);
 int connSend(char const *hostname, int port, const std::string& oss);
-int connRead(int connection, char* buffer, int buffer_size);
+bool connWrite(int connection, const std::string& data);
+bool connReadReply(int connection, std::string& buffer, std::string& reply);
+
+// returns -1 with the failing call in section, and errno set
+int connListen(char const *bind, int port, std::string& section);
+// returns -1 when there are no more connections to accept, or -2 on error
+int connAccept(int sockfd);
+void setNonBlocking(int fd);
+// reads what's available and calls process for each complete command
+// returns the number of bytes read
+size_t readCommands(Connection& conn, const std::function<std::string(std::vector<std::string>&)>& process);
+// returns the number of bytes written
+size_t writeConnection(Connection& conn);
+// address of the other end, like 127.0.0.1:50000
+std::string connPeer(int fd);
+
+// comma-separated list of host:port
+bool parseServers(const std::string& str, std::vector<std::pair<std::string, int>>& servers);
 
 } // namespace morph
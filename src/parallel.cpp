@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "parallel.h"
+
+namespace morph {
+
+// runs fn(i) for the remaining indexes, and records the first exception
+struct Job {
+  size_t n;
+  const std::function<void(size_t)>* fn;
+  std::atomic<size_t> next;
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  void work() {
+    size_t i;
+    while ((i = next++) < n) {
+      try {
+        (*fn)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error) {
+          error = std::current_exception();
+        }
+        // skip remaining work
+        next = n;
+      }
+    }
+  }
+};
+
+// set on pool threads and the thread running a job, so nested calls don't wait on the pool
+thread_local bool in_pool = false;
+
+// threads kept between calls, since starting them costs more than small batches of work
+class WorkerPool {
+  public:
+    WorkerPool(size_t size) : size_(size), pid_(getpid()) {
+      for (size_t t = 0; t < size_; t++) {
+        std::thread([this]() { loop(); }).detach();
+      }
+    }
+
+    // returns false if another thread is using the pool, or in a forked child,
+    // which doesn't have the threads
+    bool tryRun(Job& job) {
+      if (in_pool || getpid() != pid_) {
+        return false;
+      }
+      std::unique_lock<std::mutex> busy(busy_mutex_, std::try_to_lock);
+      if (!busy.owns_lock()) {
+        return false;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        job_ = &job;
+        finished_ = 0;
+        generation_++;
+      }
+      wake_.notify_all();
+
+      in_pool = true;
+      job.work();
+      in_pool = false;
+
+      // every thread finishes with the job before it goes out of scope
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [&]() { return finished_ == size_; });
+      job_ = nullptr;
+      return true;
+    }
+
+  private:
+    size_t size_;
+    pid_t pid_;
+    std::mutex busy_mutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    Job* job_ = nullptr;
+    uint64_t generation_ = 0;
+    size_t finished_ = 0;
+
+    void loop() {
+      in_pool = true;
+      uint64_t seen = 0;
+      while (true) {
+        Job* job;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          wake_.wait(lock, [&]() { return generation_ != seen; });
+          seen = generation_;
+          job = job_;
+        }
+        job->work();
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          finished_++;
+        }
+        done_.notify_one();
+      }
+    }
+};
+
+void parallelFor(size_t n, const std::function<void(size_t)>& fn) {
+  size_t threads = std::max(1U, std::thread::hardware_concurrency());
+  size_t workers = std::min<size_t>(n, threads);
+  if (workers <= 1) {
+    for (size_t i = 0; i < n; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  Job job;
+  job.n = n;
+  job.fn = &fn;
+  job.next = 0;
+
+  // never destroyed, since the threads run until exit
+  static WorkerPool* pool = new WorkerPool(threads - 1);
+  if (!pool->tryRun(job)) {
+    // start threads for this call instead
+    std::vector<std::thread> spawned;
+    for (size_t t = 1; t < workers; t++) {
+      spawned.emplace_back([&job]() { job.work(); });
+    }
+    job.work();
+    for (auto& thread : spawned) {
+      thread.join();
+    }
+  }
+
+  if (job.error) {
+    std::rethrow_exception(job.error);
+  }
+}
+
+} // namespace morph
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+namespace morph {
+
+// calls fn(i) for i in [0, n) across hardware threads, using a pool of threads
+// kept between calls, and rethrows the first exception after all threads finish
+void parallelFor(size_t n, const std::function<void(size_t)>& fn);
+
+} // namespace morph
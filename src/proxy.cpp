@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <helib/helib.h>
+
+#include "encryption.h"
+#include "network.h"
+#include "proxy.h"
+#include "resp.h"
+#include "version.h"
+
+namespace morph {
+
+void Proxy::handleError(const std::string& section, const std::string& message) {
+  std::cerr
+    << "Could not create proxy TCP listening socket "
+    << options_.bind << ":" << options_.port << ": "
+    << section << ": " << message << std::endl;
+  exit(1);
+}
+
+void closeBackend(Backend& backend) {
+  close(backend.fd);
+  backend.fd = -1;
+  backend.buffer.clear();
+}
+
+// sends the request to all targets at once and waits for every reply
+bool Proxy::forward(const std::vector<size_t>& targets, const std::string& request, std::vector<std::string>& replies, std::string& err) {
+  replies.assign(targets.size(), "");
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<size_t> pending;
+  for (size_t i = 0; i < targets.size(); i++) {
+    auto& backend = backends_[targets[i]];
+    if (backend.fd == -1) {
+      std::string message;
+      backend.fd = connTryOpen(backend.hostname.c_str(), backend.port, message);
+      if (backend.fd == -1) {
+        backend.errors++;
+        err = "ERR backend " + backend.hostname + ":" + std::to_string(backend.port) + " unavailable: " + message;
+        continue;
+      }
+    }
+    if (!connWrite(backend.fd, request)) {
+      backend.errors++;
+      closeBackend(backend);
+      err = "ERR backend " + backend.hostname + ":" + std::to_string(backend.port) + " closed the connection";
+      continue;
+    }
+    pending.push_back(i);
+  }
+
+  // gather replies as they arrive to measure each backend
+  auto deadline = start + std::chrono::seconds(options_.timeout);
+  char chunk[65536];
+  while (!pending.empty()) {
+    std::vector<pollfd> fds;
+    for (auto i : pending) {
+      fds.push_back({backends_[targets[i]].fd, POLLIN, 0});
+    }
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    int ready = poll(fds.data(), fds.size(), std::max<long>(remaining, 0));
+    if (ready <= 0) {
+      if (ready < 0 && errno == EINTR) {
+        continue;
+      }
+      err = "ERR " + std::string(std::strerror(errno));
+      // a late reply would otherwise be read as the reply to the next request
+      for (auto i : pending) {
+        auto& backend = backends_[targets[i]];
+        backend.errors++;
+        closeBackend(backend);
+        if (ready == 0) {
+          err = "ERR backend " + backend.hostname + ":" + std::to_string(backend.port) + " timed out";
+        }
+      }
+      return false;
+    }
+
+    std::vector<size_t> still_pending;
+    for (size_t j = 0; j < pending.size(); j++) {
+      auto i = pending[j];
+      auto& backend = backends_[targets[i]];
+      if (fds[j].revents == 0) {
+        still_pending.push_back(i);
+        continue;
+      }
+
+      auto bytesRead = read(backend.fd, chunk, sizeof(chunk));
+      if (bytesRead <= 0) {
+        backend.errors++;
+        closeBackend(backend);
+        err = "ERR backend " + backend.hostname + ":" + std::to_string(backend.port) + " closed the connection";
+        continue;
+      }
+      backend.buffer.append(chunk, bytesRead);
+
+      auto len = replyLength(backend.buffer.data(), backend.buffer.size());
+      if (len == 0) {
+        still_pending.push_back(i);
+        continue;
+      }
+      if (len < 0) {
+        backend.errors++;
+        closeBackend(backend);
+        err = "ERR bad reply from backend " + backend.hostname + ":" + std::to_string(backend.port);
+        continue;
+      }
+
+      replies[i] = backend.buffer.substr(0, len);
+      backend.buffer.erase(0, len);
+
+      double usec = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+      backend.calls++;
+      backend.total_usec += usec;
+      backend.last_usec = usec;
+      backend.max_usec = std::max(backend.max_usec, usec);
+    }
+    pending = still_pending;
+  }
+
+  return err.empty();
+}
+
+// adds partial results homomorphically, which only requires the public key
+// since at most one backend has a matching key, the sum is the value
+// values with several chunks are added chunk by chunk
+std::string Proxy::add(const std::vector<std::string>& values) {
+  std::vector<helib::Ctxt> sum;
+  for (const auto& value : values) {
+    // backends without keys return null
+    if (value.empty()) {
+      continue;
+    }
+    std::istringstream iss(value);
+    auto chunks = readChunks(iss, *pkp_.get());
+    for (size_t i = 0; i < chunks.size(); i++) {
+      if (i < sum.size()) {
+        sum[i] += chunks[i];
+      } else {
+        sum.push_back(std::move(chunks[i]));
+      }
+    }
+  }
+  return chunksToString(sum);
+}
+
+std::string Proxy::processCommand(std::vector<std::string>& cmd) {
+  std::string command = cmd[0];
+  for (auto &c : command) {
+    c = tolower(c);
+  }
+
+  if (command == "info") {
+    return respBulkString(info());
+  }
+
+  std::vector<size_t> targets;
+  if (command == "set" || command == "setex" || command == "mset") {
+    // any backend works since gets go to all of them
+    targets.push_back(next_backend_);
+    next_backend_ = (next_backend_ + 1) % backends_.size();
+  } else if (command == "get" || command == "mget" || command == "exists" || command == "flushall" || command == "dbsize"
+      || command == "keys" || command == "save" || command == "bgsave") {
+    for (size_t i = 0; i < backends_.size(); i++) {
+      targets.push_back(i);
+    }
+  } else {
+    return respError("ERR unknown command '" + command + "'");
+  }
+
+  std::vector<std::string> replies;
+  std::string err;
+  if (!forward(targets, respArray(cmd), replies, err)) {
+    return respError(err);
+  }
+
+  std::vector<Result> results;
+  for (const auto& reply : replies) {
+    results.push_back(readResult(reply));
+    if (results.back().type == RESP_ERROR) {
+      return reply;
+    }
+  }
+
+  try {
+    if (command == "get" || command == "exists") {
+      std::vector<std::string> values;
+      for (const auto& res : results) {
+        values.push_back(res.value_str);
+      }
+      return respBulkString(add(values));
+    } else if (command == "mget") {
+      std::vector<std::string> arr;
+      for (size_t i = 0; i < results[0].value_arr.size(); i++) {
+        std::vector<std::string> values;
+        for (const auto& res : results) {
+          values.push_back(res.value_arr.at(i));
+        }
+        arr.push_back(add(values));
+      }
+      return respArray(arr);
+    }
+  } catch (const std::exception& e) {
+    return respError("ERR " + std::string(e.what()));
+  }
+
+  if (command == "dbsize") {
+    int total = 0;
+    for (const auto& res : results) {
+      total += res.value_int;
+    }
+    return respInteger(total);
+  } else if (command == "keys") {
+    std::vector<std::string> arr;
+    for (const auto& res : results) {
+      arr.insert(arr.end(), res.value_arr.begin(), res.value_arr.end());
+    }
+    return respArray(arr);
+  }
+  return replies[0];
+}
+
+std::string Proxy::info() {
+  std::ostringstream oss;
+  oss << "# Proxy\r\n"
+    << "morph_version:" << MORPH_VERSION << "\r\n"
+    << "backends:" << backends_.size() << "\r\n"
+    << "\r\n"
+    << "# Backends\r\n";
+  for (size_t i = 0; i < backends_.size(); i++) {
+    const auto& backend = backends_[i];
+    oss << "backend" << i << ":"
+      << "host=" << backend.hostname
+      << ",port=" << backend.port
+      << ",connected=" << (backend.fd != -1 ? 1 : 0)
+      << ",calls=" << backend.calls
+      << ",errors=" << backend.errors
+      << ",usec_per_call=" << static_cast<long>(backend.calls > 0 ? backend.total_usec / backend.calls : 0)
+      << ",last_usec=" << static_cast<long>(backend.last_usec)
+      << ",max_usec=" << static_cast<long>(backend.max_usec)
+      << "\r\n";
+  }
+  return oss.str();
+}
+
+void Proxy::start() {
+  std::tie(contextp_, pkp_) = loadContextAndKey<helib::PubKey>(options_.pk_path, false);
+
+  for (const auto& server : options_.backends) {
+    Backend backend;
+    backend.hostname = server.first;
+    backend.port = server.second;
+    backends_.push_back(backend);
+  }
+
+  // write errors are handled where they occur
+  signal(SIGPIPE, SIG_IGN);
+
+  std::string section;
+  int sockfd = connListen(options_.bind.c_str(), options_.port, section);
+  if (sockfd == -1) {
+    handleError(section, std::strerror(errno));
+  }
+
+  std::cerr << "Ready to accept connections" << std::endl;
+
+  std::vector<Connection> connections;
+
+  while (1) {
+    std::vector<pollfd> fds;
+    fds.push_back({sockfd, POLLIN, 0});
+    for (const auto& conn : connections) {
+      short events = conn.output.empty() ? POLLIN : (POLLIN | POLLOUT);
+      fds.push_back({conn.fd, events, 0});
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handleError("poll", std::strerror(errno));
+    }
+
+    for (int i = 1; i < fds.size(); i++) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        readCommands(connections[i - 1], [&](std::vector<std::string>& cmd) {
+          return processCommand(cmd);
+        });
+      }
+      writeConnection(connections[i - 1]);
+    }
+
+    connections.erase(std::remove_if(connections.begin(), connections.end(), [](const Connection& conn) {
+      if (conn.closing && conn.output.empty()) {
+        close(conn.fd);
+        return true;
+      }
+      return false;
+    }), connections.end());
+
+    if (fds[0].revents & POLLIN) {
+      int connection;
+      while ((connection = connAccept(sockfd)) >= 0) {
+        connections.push_back({connection});
+      }
+      if (connection == -2) {
+        handleError("accept", std::strerror(errno));
+      }
+    }
+  }
+
+  close(sockfd);
+}
+
+} // namespace morph
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2020 Andrew Kane
+ *
+ * This program is Licensed under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. See accompanying LICENSE file.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <helib/helib.h>
+
+namespace morph {
+
+struct ProxyOptions {
+  std::string bind = "127.0.0.1";
+  int port = 6775;
+  std::string pk_path = "morph.pk";
+  // hostname and port of each server
+  std::vector<std::pair<std::string, int>> backends;
+  // seconds to wait for replies, since the proxy can't serve other clients meanwhile
+  int timeout = 60;
+};
+
+struct Backend {
+  std::string hostname;
+  int port;
+  int fd = -1;
+  std::string buffer;
+
+  // latency stats
+  long calls = 0;
+  long errors = 0;
+  double total_usec = 0;
+  double max_usec = 0;
+  double last_usec = 0;
+};
+
+class Proxy {
+  public:
+    Proxy(ProxyOptions& options) {
+      options_ = options;
+    }
+    void start();
+
+  private:
+    ProxyOptions options_;
+    std::shared_ptr<helib::Context> contextp_;
+    std::unique_ptr<helib::PubKey> pkp_;
+    std::vector<Backend> backends_;
+    size_t next_backend_ = 0;
+
+    void handleError(const std::string& section, const std::string& message);
+    std::string processCommand(std::vector<std::string>& cmd);
+    bool forward(const std::vector<size_t>& targets, const std::string& request, std::vector<std::string>& replies, std::string& err);
+    std::string add(const std::vector<std::string>& values);
+    std::string info();
+};
+
+} // namespace morph
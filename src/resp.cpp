@@ -14,6 +14,8 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -31,7 +33,7 @@ std::string respError(const std::string& value) {
   return "-" + value + "\r\n";
 }
 
-std::string respInteger(int value) {
+std::string respInteger(long long value) {
   return ":" + std::to_string(value) + "\r\n";
 }
 
@@ -54,6 +56,14 @@ std::string respArray(const std::vector<std::string>& value) {
   return oss.str();
 }
 
+std::string respEncodedArray(const std::vector<std::string>& values) {
+  std::string str = "*" + std::to_string(values.size()) + "\r\n";
+  for (const auto& v : values) {
+    str += v;
+  }
+  return str;
+}
+
 std::string readBulkString(const char*& p) {
   if (*p != '$') {
     // TODO throw error
@@ -102,31 +112,53 @@ std::vector<std::string> readArray(const char* buffer) {
   return vec;
 }
 
-Result readResult(const std::string& str) {
-  const char *buffer = str.c_str();
-
+// reads a complete value and moves p past it
+Result readElement(const char*& p) {
   Result res;
-  switch(str[0]) {
+  char type = *p;
+  const char* end = p + 1;
+  while (*end != '\0' && *end != '\r') {
+    end++;
+  }
+  std::string line(p + 1, end);
+  p = *end == '\0' ? end : end + 2;
+
+  switch(type) {
     case '+':
       res.type = RESP_SIMPLE_STRING;
-      res.value_str = str.substr(1, str.size() - 2);
+      res.value_str = line;
       break;
     case '-':
       res.type = RESP_ERROR;
-      res.value_str = str.substr(1, str.size() - 2);
+      res.value_str = line;
       break;
     case ':':
       res.type = RESP_INTEGER;
-      res.value_int = std::atoi(str.substr(1, str.size() - 2).c_str());
+      res.value_int = std::atoi(line.c_str());
       break;
     case '$':
-      res.type = RESP_BULK_STRING;
-      // TODO handle null in readBulkString
-      res.value_str = (str == "$-1\r\n") ? "" : readBulkString(buffer);
+      {
+        res.type = RESP_BULK_STRING;
+        // null is read as an empty string
+        long len = std::atol(line.c_str());
+        if (len > 0) {
+          res.value_str.assign(p, len);
+          p += len + 2;
+        } else if (len == 0) {
+          p += 2;
+        }
+      }
       break;
     case '*':
-      res.type = RESP_ARRAY;
-      res.value_arr = readArray(buffer);
+      {
+        res.type = RESP_ARRAY;
+        long len = std::atol(line.c_str());
+        for (long i = 0; i < len; i++) {
+          auto element = readElement(p);
+          res.value_arr.push_back(element.type == RESP_INTEGER ? std::to_string(element.value_int) : element.value_str);
+          res.elements.push_back(std::move(element));
+        }
+      }
       break;
     default:
       res.type = RESP_UNKNOWN;
@@ -134,4 +166,139 @@ Result readResult(const std::string& str) {
   return res;
 }
 
+Result readResult(const std::string& str) {
+  const char *buffer = str.c_str();
+  return readElement(buffer);
+}
+
+// returns 1 if read, 0 if incomplete, or -1 if malformed
+int readLength(const char* buffer, size_t size, size_t& pos, long& value) {
+  bool negative = false;
+  if (pos < size && buffer[pos] == '-') {
+    negative = true;
+    pos++;
+  }
+
+  long len = 0;
+  int digits = 0;
+  while (pos < size && buffer[pos] != '\r') {
+    if (buffer[pos] < '0' || buffer[pos] > '9' || digits > 10) {
+      return -1;
+    }
+    len = (len*10)+(buffer[pos] - '0');
+    digits++;
+    pos++;
+  }
+  if (pos + 1 >= size) {
+    return 0;
+  }
+  if (buffer[pos + 1] != '\n' || digits == 0) {
+    return -1;
+  }
+  pos += 2;
+
+  value = negative ? -len : len;
+  return 1;
+}
+
+long readCommand(const char* buffer, size_t size, std::vector<std::string>& cmd) {
+  if (size == 0) {
+    return 0;
+  }
+  if (buffer[0] != '*') {
+    return -1;
+  }
+
+  size_t pos = 1;
+  long len;
+  int status = readLength(buffer, size, pos, len);
+  if (status <= 0) {
+    return status;
+  }
+  if (len < 0) {
+    return -1;
+  }
+
+  std::vector<std::string> vec;
+  vec.reserve(std::min(len, 1024L));
+  for (long i = 0; i < len; i++) {
+    if (pos >= size) {
+      return 0;
+    }
+    if (buffer[pos] != '$') {
+      return -1;
+    }
+    pos++;
+
+    long str_len;
+    status = readLength(buffer, size, pos, str_len);
+    if (status <= 0) {
+      return status;
+    }
+    // we use empty string to represent null
+    if (str_len < 0) {
+      vec.emplace_back();
+      continue;
+    }
+    if (size - pos < static_cast<size_t>(str_len) + 2) {
+      return 0;
+    }
+    if (buffer[pos + str_len] != '\r' || buffer[pos + str_len + 1] != '\n') {
+      return -1;
+    }
+    vec.emplace_back(buffer + pos, str_len);
+    pos += str_len + 2;
+  }
+
+  cmd = std::move(vec);
+  return pos;
+}
+
+long replyLength(const char* buffer, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+
+  size_t pos = 1;
+  long len;
+  switch (buffer[0]) {
+    case '+':
+    case '-':
+    case ':':
+      while (pos + 1 < size) {
+        if (buffer[pos] == '\r' && buffer[pos + 1] == '\n') {
+          return pos + 2;
+        }
+        pos++;
+      }
+      return 0;
+    case '$': {
+      int status = readLength(buffer, size, pos, len);
+      if (status <= 0 || len < 0) {
+        return status <= 0 ? status : pos;
+      }
+      if (size - pos < static_cast<size_t>(len) + 2) {
+        return 0;
+      }
+      return pos + len + 2;
+    }
+    case '*': {
+      int status = readLength(buffer, size, pos, len);
+      if (status <= 0) {
+        return status;
+      }
+      for (long i = 0; i < len; i++) {
+        long element = replyLength(buffer + pos, size - pos);
+        if (element <= 0) {
+          return element;
+        }
+        pos += element;
+      }
+      return pos;
+    }
+    default:
+      return -1;
+  }
+}
+
 } // namespace morph
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <cstddef>
 #include <string>
 #include <vector>
 
@@ -28,16 +29,25 @@ struct Result {
   std::string value_str;
   int value_int;
   std::vector<std::string> value_arr;
+  // every element of an array, including integers and nested arrays
+  std::vector<Result> elements;
 };
 
 std::string respOk();
 std::string respError(const std::string& value);
-std::string respInteger(int value);
+std::string respInteger(long long value);
 std::string respBulkString(const std::string& value);
 std::string respArray(const std::vector<std::string>& value);
+// for elements that are already encoded, like integers and nested arrays
+std::string respEncodedArray(const std::vector<std::string>& values);
 
 std::string readBulkString(const char*& p);
 std::vector<std::string> readArray(const char* buffer);
 Result readResult(const std::string& str);
 
+// incremental parsing for persistent connections
+// return the number of bytes used, 0 if incomplete, or -1 if malformed
+long readCommand(const char* buffer, size_t size, std::vector<std::string>& cmd);
+long replyLength(const char* buffer, size_t size);
+
 } // namespace morph
@@ -14,15 +14,31 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
-#include <arpa/inet.h>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <chrono>
+#include <csignal>
 #include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
-#include <netinet/in.h>
+#include <iterator>
+#include <new>
+#include <poll.h>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <vector>
 
+#include "encryption.h"
 #include "network.h"
 #include "resp.h"
 #include "server.h"
@@ -35,71 +51,1397 @@ std::string wrongArgs(const std::string& cmd) {
   return respError("ERR wrong number of arguments for '" + cmd + "' command");
 }
 
-std::string processCommand(std::vector<std::string>& cmd, morph::Store& store) {
-  std::string command = cmd[0];
+// non-negative integer arguments
+bool parseIndex(const std::string& str, size_t& value) {
+  if (str.empty() || str.size() > 18 || !std::all_of(str.begin(), str.end(), ::isdigit)) {
+    return false;
+  }
+  value = std::stoull(str);
+  return true;
+}
+
+// keys are ciphertexts, so they can't be mistaken for an option
+bool isOption(const std::string& arg) {
+  if (arg.size() > 7) {
+    return false;
+  }
+  std::string option = arg;
+  for (auto &c : option) {
+    c = tolower(c);
+  }
+  return option == "ex" || option == "px" || option == "pxat" || option == "buckets" || option == "pack" || option == "expires";
+}
+
+// position of the first option, or the end
+size_t optionsStart(const std::vector<std::string>& cmd, size_t from) {
+  for (size_t i = from; i < cmd.size(); i++) {
+    if (isOption(cmd[i])) {
+      return i;
+    }
+  }
+  return cmd.size();
+}
+
+// EX seconds, PX milliseconds, or PXAT unix time in milliseconds
+// to unix time in milliseconds
+bool parseExpire(std::string option, const std::string& value, int64_t& expire_at) {
+  for (auto &c : option) {
+    c = tolower(c);
+  }
+  size_t n;
+  if (!parseIndex(value, n) || n == 0 || n > 1e15) {
+    return false;
+  }
+  if (option == "ex") {
+    expire_at = unixTimeMs() + n * 1000;
+  } else if (option == "px") {
+    expire_at = unixTimeMs() + n;
+  } else {
+    expire_at = n;
+  }
+  return true;
+}
+
+struct KeyOptions {
+  // unix time in milliseconds, or 0 for none
+  int64_t expire_at = 0;
+  // a tag for each key, or empty for none
+  std::vector<uint32_t> buckets;
+  // an expiration time for each key with restore, or empty for none
+  std::vector<int64_t> expires;
+  // slots per value for packed replies, or 0 for one ciphertext per value
+  size_t pack = 0;
+};
+
+// EX, PX, or PXAT and PACK width when allowed, and BUCKETS with a tag for each key
+// restore has EXPIRES with a unix time in milliseconds or 0 for each key, and empty tags for keys without one
+// returns an error reply, or an empty string
+std::string parseKeyOptions(const std::vector<std::string>& cmd, size_t start, size_t keys, const std::string& command, bool expire, KeyOptions& options, bool pack = false, bool restore = false) {
+  size_t i = start;
+  while (i < cmd.size()) {
+    std::string option = cmd[i];
+    for (auto &c : option) {
+      c = tolower(c);
+    }
+    if (expire && (option == "ex" || option == "px" || option == "pxat")) {
+      if (i + 1 >= cmd.size()) {
+        return respError("ERR syntax error");
+      }
+      if (!parseExpire(option, cmd[i + 1], options.expire_at)) {
+        return respError("ERR invalid expire time in '" + command + "' command");
+      }
+      i += 2;
+    } else if (pack && option == "pack") {
+      if (i + 1 >= cmd.size()) {
+        return respError("ERR syntax error");
+      }
+      if (!parseIndex(cmd[i + 1], options.pack) || options.pack < 2) {
+        return respError("ERR invalid pack width");
+      }
+      i += 2;
+    } else if (restore && option == "expires") {
+      if (cmd.size() - i - 1 < keys) {
+        return respError("ERR syntax error");
+      }
+      options.expires.clear();
+      for (size_t j = i + 1; j <= i + keys; j++) {
+        size_t n;
+        if (!parseIndex(cmd[j], n) || n > 1e15) {
+          return respError("ERR invalid expire time in '" + command + "' command");
+        }
+        options.expires.push_back(n);
+      }
+      i += keys + 1;
+    } else if (option == "buckets") {
+      if (cmd.size() - i - 1 < keys) {
+        return respError("ERR syntax error");
+      }
+      options.buckets.clear();
+      for (size_t j = i + 1; j <= i + keys; j++) {
+        size_t bucket;
+        if (restore && cmd[j].empty()) {
+          bucket = NO_BUCKET;
+        } else if (!parseIndex(cmd[j], bucket) || bucket >= NO_BUCKET) {
+          return respError("ERR invalid bucket");
+        }
+        options.buckets.push_back(bucket);
+      }
+      i += keys + 1;
+    } else {
+      return respError("ERR syntax error");
+    }
+  }
+  return "";
+}
+
+// replaces the options with the form written to the append only file and replicas,
+// with an absolute time so they expire it at the same time
+void canonicalOptions(std::vector<std::string>& cmd, size_t start, const KeyOptions& options) {
+  cmd.resize(start);
+  if (options.expire_at != 0) {
+    cmd.push_back("pxat");
+    cmd.push_back(std::to_string(options.expire_at));
+  }
+  if (!options.buckets.empty()) {
+    cmd.push_back("buckets");
+    for (auto bucket : options.buckets) {
+      cmd.push_back(std::to_string(bucket));
+    }
+  }
+}
+
+// the command table, with arity like Redis: the number of arguments including the name,
+// or the negative of the minimum, and key positions for COMMAND
+constexpr Command Server::COMMANDS[] = {
+  {"set", -3, CMD_WRITE | CMD_DENYOOM | CMD_FAST, 1, 1, 1, &Server::setCommand},
+  {"setex", -4, CMD_WRITE | CMD_DENYOOM | CMD_FAST, 1, 1, 1, &Server::setexCommand},
+  {"mset", -3, CMD_WRITE | CMD_DENYOOM, 1, -1, 2, &Server::msetCommand},
+  {"get", -2, CMD_READONLY | CMD_HOMOMORPHIC, 1, 1, 1, &Server::getCommand},
+  {"mget", -2, CMD_READONLY | CMD_HOMOMORPHIC, 1, -1, 1, &Server::mgetCommand},
+  {"exists", -2, CMD_READONLY | CMD_HOMOMORPHIC, 1, -1, 1, &Server::existsCommand},
+  {"flushall", 1, CMD_WRITE, 0, 0, 0, &Server::flushallCommand},
+  {"flushdb", 1, CMD_WRITE, 0, 0, 0, &Server::flushdbCommand},
+  {"select", 2, CMD_FAST, 0, 0, 0, &Server::selectCommand},
+  {"dump", 3, CMD_READONLY, 0, 0, 0, &Server::dumpCommand},
+  {"restore", -3, CMD_WRITE | CMD_DENYOOM, 1, -1, 2, &Server::restoreCommand},
+  {"delrange", 3, CMD_WRITE, 0, 0, 0, &Server::delrangeCommand},
+  {"purge", 2, CMD_WRITE | CMD_INTERNAL, 0, 0, 0, &Server::purgeCommand},
+  // only writes without COPY, which it checks itself
+  {"migrate", -5, CMD_ADMIN, 0, 0, 0, &Server::migrateCommand},
+  {"dbsize", 1, CMD_READONLY | CMD_FAST, 0, 0, 0, &Server::dbsizeCommand},
+  {"keys", 2, CMD_READONLY, 0, 0, 0, &Server::keysCommand},
+  {"scan", -2, CMD_READONLY, 0, 0, 0, &Server::scanCommand},
+  {"save", 1, CMD_ADMIN, 0, 0, 0, &Server::saveCommand},
+  {"bgsave", 1, CMD_ADMIN, 0, 0, 0, &Server::bgsaveCommand},
+  {"lastsave", 1, CMD_FAST, 0, 0, 0, &Server::lastsaveCommand},
+  {"rewriteaof", 1, CMD_ADMIN, 0, 0, 0, &Server::rewriteaofCommand},
+  {"replicaof", 3, CMD_ADMIN, 0, 0, 0, &Server::replicaofCommand},
+  {"info", -1, 0, 0, 0, 0, &Server::infoCommand},
+  {"latency", -2, CMD_ADMIN, 0, 0, 0, &Server::latencyCommand},
+  {"slowlog", -2, CMD_ADMIN, 0, 0, 0, &Server::slowlogCommand},
+  {"debug", -2, CMD_ADMIN, 0, 0, 0, &Server::debugCommand},
+  {"command", -1, 0, 0, 0, 0, &Server::commandCommand}
+};
+
+// case-insensitive FNV-1a with a seed, so lookups don't copy the name
+constexpr uint32_t commandHash(std::string_view name, uint32_t seed) {
+  uint32_t hash = 2166136261u ^ seed;
+  for (char c : name) {
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 16777619u;
+  }
+  return hash ^ (hash >> 16);
+}
+
+const size_t COMMAND_SLOTS = 128;
+
+constexpr bool isPerfectSeed(uint32_t seed) {
+  bool used[COMMAND_SLOTS] = {};
+  for (const auto& command : Server::COMMANDS) {
+    auto slot = commandHash(command.name, seed) % COMMAND_SLOTS;
+    if (used[slot]) {
+      return false;
+    }
+    used[slot] = true;
+  }
+  return true;
+}
+
+// search for a seed with no collisions at compile time
+constexpr uint32_t perfectSeed() {
+  uint32_t seed = 0;
+  while (!isPerfectSeed(seed)) {
+    seed++;
+  }
+  return seed;
+}
+
+constexpr uint32_t COMMAND_SEED = perfectSeed();
+
+// position in the command table of each slot, or -1
+constexpr std::array<int8_t, COMMAND_SLOTS> commandSlots() {
+  std::array<int8_t, COMMAND_SLOTS> slots = {};
+  for (auto& slot : slots) {
+    slot = -1;
+  }
+  for (size_t i = 0; i < std::size(Server::COMMANDS); i++) {
+    slots[commandHash(Server::COMMANDS[i].name, COMMAND_SEED) % COMMAND_SLOTS] = i;
+  }
+  return slots;
+}
+
+constexpr auto COMMAND_TABLE = commandSlots();
+
+const Command* Server::lookupCommand(const std::string& name) {
+  auto index = COMMAND_TABLE[commandHash(name, COMMAND_SEED) % COMMAND_SLOTS];
+  if (index == -1) {
+    return nullptr;
+  }
+  const Command* command = &COMMANDS[index];
+  std::string_view expected(command->name);
+  if (name.size() != expected.size() || !std::equal(name.begin(), name.end(), expected.begin(), [](char a, char b) { return tolower(a) == b; })) {
+    return nullptr;
+  }
+  return command;
+}
+
+std::string unknownCommand(const std::string& name) {
+  std::string command = name;
   for (auto &c : command) {
     c = tolower(c);
   }
+  return respError("ERR unknown command '" + command + "'");
+}
 
-  int argc = cmd.size() - 1;
+std::string Server::processCommand(std::vector<std::string>& cmd) {
+  auto command = lookupCommand(cmd[0]);
+  if (!command) {
+    return unknownCommand(cmd[0]);
+  }
+  return dispatch(*command, cmd);
+}
 
-  if (command == "set") {
-    if (argc != 2) {
-      return wrongArgs("set");
+std::string Server::dispatch(const Command& command, std::vector<std::string>& cmd) {
+  int argc = cmd.size();
+  if (command.arity > 0 ? argc != command.arity : argc < -command.arity) {
+    return wrongArgs(command.name);
+  }
+  // replicas only change with the master
+  if ((command.flags & CMD_WRITE) && !options_.master_host.empty() && !replaying_) {
+    return respError("READONLY You can't write against a read only replica.");
+  }
+  // the master enforces the limit for its replicas and the append only file
+  if ((command.flags & CMD_DENYOOM) && options_.maxmemory > 0 && !replaying_ && usedMemory() >= options_.maxmemory) {
+    rejected_writes_++;
+    return respError("OOM command not allowed when used memory > 'maxmemory'.");
+  }
+  // a malformed ciphertext throws while it's deserialized,
+  // and commands don't change anything until every argument is valid
+  try {
+    return (this->*command.proc)(cmd);
+  } catch (const std::exception& e) {
+    return respError("ERR Bad data format");
+  }
+}
+
+std::string Server::setCommand(std::vector<std::string>& cmd) {
+  KeyOptions options;
+  auto err = parseKeyOptions(cmd, 3, 1, "set", true, options);
+  if (!err.empty()) {
+    return err;
+  }
+  dbs_[db_]->set(cmd[1], cmd[2], options.expire_at, options.buckets.empty() ? NO_BUCKET : options.buckets[0]);
+  dirty_++;
+  canonicalOptions(cmd, 3, options);
+  propagate(cmd);
+  return respOk();
+}
+
+// SETEX key seconds value is SET key value EX seconds
+std::string Server::setexCommand(std::vector<std::string>& cmd) {
+  std::vector<std::string> rewritten = {"set", cmd[1], cmd[3], "ex", cmd[2]};
+  rewritten.insert(rewritten.end(), cmd.begin() + 4, cmd.end());
+  cmd = std::move(rewritten);
+  return setCommand(cmd);
+}
+
+std::string Server::msetCommand(std::vector<std::string>& cmd) {
+  size_t pairs_end = optionsStart(cmd, 1);
+  if (pairs_end < 3 || (pairs_end - 1) % 2 != 0) {
+    return wrongArgs("mset");
+  }
+  size_t count = (pairs_end - 1) / 2;
+  KeyOptions options;
+  auto err = parseKeyOptions(cmd, pairs_end, count, "mset", true, options);
+  if (!err.empty()) {
+    return err;
+  }
+  // deserialized in parallel and appended in order,
+  // and nothing is added unless every entry is valid
+  std::vector<std::pair<std::string, std::string>> pairs;
+  pairs.reserve(count);
+  for (size_t i = 1; i < pairs_end; i += 2) {
+    pairs.emplace_back(std::move(cmd[i]), std::move(cmd[i + 1]));
+  }
+  dbs_[db_]->setMany(pairs, std::vector<int64_t>(options.expire_at != 0 ? count : 0, options.expire_at), options.buckets);
+  for (size_t i = 0; i < count; i++) {
+    cmd[i * 2 + 1] = std::move(pairs[i].first);
+    cmd[i * 2 + 2] = std::move(pairs[i].second);
+  }
+  dirty_ += count;
+  canonicalOptions(cmd, pairs_end, options);
+  propagate(cmd);
+  return respOk();
+}
+
+std::string Server::getCommand(std::vector<std::string>& cmd) {
+  KeyOptions options;
+  auto err = parseKeyOptions(cmd, 2, 1, "get", false, options);
+  if (!err.empty()) {
+    return err;
+  }
+  return respBulkString(dbs_[db_]->get(cmd[1], options.buckets.empty() ? NO_BUCKET : options.buckets[0]));
+}
+
+std::string Server::mgetCommand(std::vector<std::string>& cmd) {
+  size_t keys_end = optionsStart(cmd, 1);
+  if (keys_end < 2) {
+    return wrongArgs("mget");
+  }
+  KeyOptions options;
+  auto err = parseKeyOptions(cmd, keys_end, keys_end - 1, "mget", false, options, true);
+  if (!err.empty()) {
+    return err;
+  }
+  std::vector<std::string> keys(cmd.begin() + 1, cmd.begin() + keys_end);
+  if (options.pack > 0) {
+    if (options.pack > dbs_[db_]->slots()) {
+      return respError("ERR invalid pack width");
     }
-    store.set(cmd[1], cmd[2]);
-    return respOk();
-  } else if (command == "mset") {
-    if (argc < 2 || argc % 2 != 0) {
-      return wrongArgs("mset");
+    return respArray(dbs_[db_]->getPacked(keys, options.buckets, options.pack));
+  }
+  return respArray(dbs_[db_]->getMany(keys, options.buckets));
+}
+
+std::string Server::existsCommand(std::vector<std::string>& cmd) {
+  size_t keys_end = optionsStart(cmd, 1);
+  if (keys_end < 2) {
+    return wrongArgs("exists");
+  }
+  KeyOptions options;
+  auto err = parseKeyOptions(cmd, keys_end, keys_end - 1, "exists", false, options);
+  if (!err.empty()) {
+    return err;
+  }
+  std::vector<std::string> keys(cmd.begin() + 1, cmd.begin() + keys_end);
+  return respBulkString(dbs_[db_]->exists(keys, options.buckets));
+}
+
+std::string Server::flushallCommand(std::vector<std::string>& cmd) {
+  for (auto& db : dbs_) {
+    dirty_ += db->size();
+    db->clear();
+  }
+  removals_++;
+  propagate(cmd);
+  return respOk();
+}
+
+std::string Server::flushdbCommand(std::vector<std::string>& cmd) {
+  dirty_ += dbs_[db_]->size();
+  dbs_[db_]->clear();
+  removals_++;
+  propagate(cmd);
+  return respOk();
+}
+
+std::string Server::selectCommand(std::vector<std::string>& cmd) {
+  size_t db;
+  if (!parseIndex(cmd[1], db)) {
+    return respError("ERR value is not an integer or out of range");
+  }
+  if (db >= dbs_.size()) {
+    return respError("ERR DB index is out of range");
+  }
+  // sent before the next propagated command when it changes
+  db_ = db;
+  return respOk();
+}
+
+// keys and values followed by the options restore takes to keep expiration times and bucket tags
+std::vector<std::string> dumpArgs(Store& store, size_t start, size_t count) {
+  std::vector<int64_t> expires;
+  std::vector<uint32_t> buckets;
+  auto args = store.dump(start, count, expires, buckets);
+  if (std::any_of(expires.begin(), expires.end(), [](int64_t expire_at) { return expire_at != 0; })) {
+    args.push_back("expires");
+    for (auto expire_at : expires) {
+      args.push_back(std::to_string(expire_at));
+    }
+  }
+  if (std::any_of(buckets.begin(), buckets.end(), [](uint32_t bucket) { return bucket != NO_BUCKET; })) {
+    args.push_back("buckets");
+    for (auto bucket : buckets) {
+      args.push_back(bucket == NO_BUCKET ? "" : std::to_string(bucket));
+    }
+  }
+  return args;
+}
+
+std::string Server::dumpCommand(std::vector<std::string>& cmd) {
+  size_t start, count;
+  if (!parseIndex(cmd[1], start) || !parseIndex(cmd[2], count)) {
+    return respError("ERR value is not an integer or out of range");
+  }
+  return respArray(dumpArgs(*dbs_[db_], start, count));
+}
+
+std::string Server::restoreCommand(std::vector<std::string>& cmd) {
+  size_t pairs_end = optionsStart(cmd, 1);
+  if (pairs_end < 3 || (pairs_end - 1) % 2 != 0) {
+    return wrongArgs("restore");
+  }
+  KeyOptions options;
+  auto err = parseKeyOptions(cmd, pairs_end, (pairs_end - 1) / 2, "restore", false, options, false, true);
+  if (!err.empty()) {
+    return err;
+  }
+  std::vector<std::pair<std::string, std::string>> pairs;
+  for (size_t i = 1; i < pairs_end; i += 2) {
+    pairs.emplace_back(cmd[i], cmd[i + 1]);
+  }
+  // nothing is added unless every entry is valid
+  dbs_[db_]->setMany(pairs, options.expires, options.buckets);
+  dirty_ += pairs.size();
+  propagate(cmd);
+  return respOk();
+}
+
+std::string Server::delrangeCommand(std::vector<std::string>& cmd) {
+  size_t start, count;
+  if (!parseIndex(cmd[1], start) || !parseIndex(cmd[2], count)) {
+    return respError("ERR value is not an integer or out of range");
+  }
+  auto& store = *dbs_[db_];
+  size_t size = store.size();
+  size_t removed = std::min(count, size - std::min(start, size));
+  store.erase(start, count);
+  dirty_ += removed;
+  removals_++;
+  propagate(cmd);
+  return respInteger(removed);
+}
+
+// what active expiration sends to replicas and the append only file,
+// and it applies to every database
+std::string Server::purgeCommand(std::vector<std::string>& cmd) {
+  size_t now;
+  if (!parseIndex(cmd[1], now)) {
+    return respError("ERR value is not an integer or out of range");
+  }
+  size_t removed = 0;
+  for (auto& db : dbs_) {
+    removed += db->expire(now);
+  }
+  if (removed > 0) {
+    dirty_ += removed;
+    removals_++;
+    expired_keys_ += removed;
+    propagate(cmd);
+  }
+  return respInteger(removed);
+}
+
+std::string Server::dbsizeCommand(std::vector<std::string>& cmd) {
+  // can't get unique keys
+  return respInteger(dbs_[db_]->size());
+}
+
+std::string Server::keysCommand(std::vector<std::string>& cmd) {
+  if (cmd[1] != "*") {
+    return respError("ERR only '*' supported");
+  }
+  return respArray(dbs_[db_]->keys());
+}
+
+// the cursor is the position of the next entry, so removing entries
+// during a scan can skip or repeat some, and there's no MATCH for ciphertexts
+std::string Server::scanCommand(std::vector<std::string>& cmd) {
+  if (cmd.size() != 2 && cmd.size() != 4) {
+    return wrongArgs("scan");
+  }
+  size_t cursor;
+  if (!parseIndex(cmd[1], cursor)) {
+    return respError("ERR invalid cursor");
+  }
+  size_t count = 10;
+  if (cmd.size() == 4) {
+    std::string option = cmd[2];
+    for (auto &c : option) {
+      c = tolower(c);
+    }
+    if (option != "count") {
+      return respError("ERR syntax error");
+    }
+    if (!parseIndex(cmd[3], count) || count == 0) {
+      return respError("ERR value is not an integer or out of range");
     }
-    for (int i = 1; i < cmd.size(); i += 2) {
-      store.set(cmd[i], cmd[i + 1]);
+  }
+  auto& store = *dbs_[db_];
+  auto keys = store.keys(cursor, count);
+  size_t next = cursor + keys.size();
+  if (next >= static_cast<size_t>(store.size())) {
+    next = 0;
+  }
+  return respEncodedArray({respBulkString(std::to_string(next)), respArray(keys)});
+}
+
+std::string Server::saveCommand(std::vector<std::string>& cmd) {
+  if (child_pid_ != -1) {
+    return respError("ERR Background save already in progress");
+  }
+  try {
+    saveSnapshot(options_.snapshot_path, dbs_);
+  } catch (const std::exception& e) {
+    std::cerr << "Error saving snapshot: " << e.what() << std::endl;
+    return respError("ERR " + std::string(e.what()));
+  }
+  dirty_ = 0;
+  lastsave_ = time(nullptr);
+  return respOk();
+}
+
+std::string Server::bgsaveCommand(std::vector<std::string>& cmd) {
+  if (child_pid_ != -1) {
+    return respError("ERR Background save already in progress");
+  }
+  if (!backgroundSave()) {
+    return respError("ERR Background save failed to start");
+  }
+  return "+Background saving started\r\n";
+}
+
+std::string Server::lastsaveCommand(std::vector<std::string>& cmd) {
+  return respInteger(lastsave_);
+}
+
+std::string Server::rewriteaofCommand(std::vector<std::string>& cmd) {
+  if (!aof_) {
+    return respError("ERR append only file is not enabled");
+  }
+  try {
+    rewriteAppendOnlyFile();
+  } catch (const std::exception& e) {
+    std::cerr << "Error rewriting append only file: " << e.what() << std::endl;
+    return respError("ERR " + std::string(e.what()));
+  }
+  return respOk();
+}
+
+std::string Server::replicaofCommand(std::vector<std::string>& cmd) {
+  std::string host = cmd[1] + " " + cmd[2];
+  for (auto &c : host) {
+    c = tolower(c);
+  }
+  if (host == "no one") {
+    if (!options_.master_host.empty()) {
+      closeMaster();
+      options_.master_host.clear();
+      std::cerr << "MASTER MODE enabled" << std::endl;
     }
     return respOk();
-  } else if (command == "get") {
-    if (argc != 1) {
-      return wrongArgs("get");
+  }
+  int port = atoi(cmd[2].c_str());
+  if (port <= 0) {
+    return respError("ERR Invalid master port");
+  }
+  if (cmd[1] == options_.master_host && port == options_.master_port) {
+    return respOk();
+  }
+  closeMaster();
+  options_.master_host = cmd[1];
+  options_.master_port = port;
+  // connect on the next cron run
+  last_master_try_ = 0;
+  std::cerr << "REPLICAOF " << cmd[1] << ":" << port << " enabled" << std::endl;
+  return respOk();
+}
+
+std::string Server::infoCommand(std::vector<std::string>& cmd) {
+  if (cmd.size() > 2) {
+    return wrongArgs("info");
+  }
+  std::string section = cmd.size() == 2 ? cmd[1] : "default";
+  for (auto &c : section) {
+    c = tolower(c);
+  }
+  return respBulkString(info(section));
+}
+
+std::string commandReply(const Command& command) {
+  std::vector<std::string> flags;
+  if (command.flags & CMD_WRITE) {
+    flags.push_back("write");
+  }
+  if (command.flags & CMD_READONLY) {
+    flags.push_back("readonly");
+  }
+  if (command.flags & CMD_ADMIN) {
+    flags.push_back("admin");
+  }
+  if (command.flags & CMD_FAST) {
+    flags.push_back("fast");
+  }
+  if (command.flags & CMD_HOMOMORPHIC) {
+    flags.push_back("homomorphic");
+  }
+  if (command.flags & CMD_DENYOOM) {
+    flags.push_back("denyoom");
+  }
+  return respEncodedArray({
+    respBulkString(command.name),
+    respInteger(command.arity),
+    respArray(flags),
+    respInteger(command.first_key),
+    respInteger(command.last_key),
+    respInteger(command.step)
+  });
+}
+
+// COMMAND replies with the name, arity, flags, and key positions of each command,
+// COMMAND INFO name ... with those of the given ones, and COMMAND COUNT with the number
+std::string Server::commandCommand(std::vector<std::string>& cmd) {
+  std::string subcommand = cmd.size() > 1 ? cmd[1] : "";
+  for (auto &c : subcommand) {
+    c = tolower(c);
+  }
+
+  std::vector<std::string> replies;
+  if (cmd.size() == 1) {
+    for (const auto& command : COMMANDS) {
+      if (!(command.flags & CMD_INTERNAL)) {
+        replies.push_back(commandReply(command));
+      }
+    }
+    return respEncodedArray(replies);
+  } else if (subcommand == "info") {
+    for (size_t i = 2; i < cmd.size(); i++) {
+      auto command = lookupCommand(cmd[i]);
+      replies.push_back(command && !(command->flags & CMD_INTERNAL) ? commandReply(*command) : respBulkString(""));
+    }
+    return respEncodedArray(replies);
+  } else if (subcommand == "count" && cmd.size() == 2) {
+    return respInteger(std::count_if(std::begin(COMMANDS), std::end(COMMANDS), [](const Command& command) { return !(command.flags & CMD_INTERNAL); }));
+  } else {
+    return respError("ERR unknown subcommand or wrong number of arguments for '" + cmd[1] + "'");
+  }
+}
+
+std::string Server::call(std::vector<std::string>& cmd) {
+  total_commands_++;
+  // only known commands so stats can't grow without bound
+  auto command = lookupCommand(cmd[0]);
+  if (!command || ((command->flags & CMD_INTERNAL) && !replaying_)) {
+    return unknownCommand(cmd[0]);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto reply = dispatch(*command, cmd);
+  uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  auto he = dbs_[db_]->takeStats();
+
+  if (options_.slowlog_log_slower_than >= 0 && usec >= static_cast<uint64_t>(options_.slowlog_log_slower_than)) {
+    uint64_t bytes = 0;
+    for (size_t i = 1; i < cmd.size(); i++) {
+      bytes += cmd[i].size();
+    }
+    slowlog_.push_front({slowlog_id_++, time(nullptr), usec, command->name, cmd.size() - 1, bytes, static_cast<size_t>(dbs_[db_]->size())});
+    while (slowlog_.size() > options_.slowlog_max_len) {
+      slowlog_.pop_back();
+    }
+  }
+
+  if (he.deserializations > 0) {
+    he_stats_.add(he);
+    he_commands_++;
+    he_queries_.push_front({he_query_id_++, command->name, static_cast<size_t>(dbs_[db_]->size()), he});
+    while (he_queries_.size() > 128) {
+      he_queries_.pop_back();
+    }
+  }
+
+  auto& stats = command_stats_[command->name];
+  stats.calls++;
+  stats.usec += usec;
+  size_t bucket = usec <= 1 ? 0 : 64 - __builtin_clzll(usec - 1);
+  stats.histogram[std::min(bucket, stats.histogram.size() - 1)]++;
+  return reply;
+}
+
+// LATENCY HISTOGRAM [command ...] replies like Redis, with cumulative counts
+// for power of two buckets, and LATENCY RESET [command ...] clears them
+std::string Server::latencyCommand(std::vector<std::string>& cmd) {
+  if (cmd.size() < 2) {
+    return wrongArgs("latency");
+  }
+  std::string subcommand = cmd[1];
+  for (auto &c : subcommand) {
+    c = tolower(c);
+  }
+
+  std::vector<std::string> names;
+  for (size_t i = 2; i < cmd.size(); i++) {
+    std::string name = cmd[i];
+    for (auto &c : name) {
+      c = tolower(c);
+    }
+    if (command_stats_.count(name)) {
+      names.push_back(name);
+    }
+  }
+  if (cmd.size() == 2) {
+    for (const auto& stats : command_stats_) {
+      names.push_back(stats.first);
+    }
+  }
+
+  if (subcommand == "histogram") {
+    std::vector<std::string> reply;
+    for (const auto& name : names) {
+      const auto& stats = command_stats_[name];
+      std::vector<std::string> buckets;
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < stats.histogram.size(); i++) {
+        if (stats.histogram[i] > 0) {
+          cumulative += stats.histogram[i];
+          buckets.push_back(respInteger(1LL << i));
+          buckets.push_back(respInteger(cumulative));
+        }
+      }
+      reply.push_back(respBulkString(name));
+      reply.push_back(respEncodedArray({
+        respBulkString("calls"),
+        respInteger(stats.calls),
+        respBulkString("histogram_usec"),
+        respEncodedArray(buckets)
+      }));
+    }
+    return respEncodedArray(reply);
+  } else if (subcommand == "reset") {
+    for (const auto& name : names) {
+      command_stats_.erase(name);
+    }
+    return respInteger(names.size());
+  } else {
+    return respError("ERR unknown subcommand '" + cmd[1] + "'");
+  }
+}
+
+// SLOWLOG GET [count] replies with the id, unix time, microseconds, command,
+// argument count, argument bytes, and store size of each entry, newest first
+std::string Server::slowlogCommand(std::vector<std::string>& cmd) {
+  if (cmd.size() < 2) {
+    return wrongArgs("slowlog");
+  }
+  std::string subcommand = cmd[1];
+  for (auto &c : subcommand) {
+    c = tolower(c);
+  }
+
+  if (subcommand == "get" && cmd.size() <= 3) {
+    size_t count = 10;
+    if (cmd.size() == 3 && !parseIndex(cmd[2], count)) {
+      return respError("ERR value is not an integer or out of range");
+    }
+    std::vector<std::string> entries;
+    for (size_t i = 0; i < std::min(count, slowlog_.size()); i++) {
+      const auto& entry = slowlog_[i];
+      entries.push_back(respEncodedArray({
+        respInteger(entry.id),
+        respInteger(entry.timestamp),
+        respInteger(entry.usec),
+        respBulkString(entry.command),
+        respInteger(entry.argc),
+        respInteger(entry.bytes),
+        respInteger(entry.store_size)
+      }));
     }
-    return respBulkString(store.get(cmd[1]));
-  } else if (command == "mget") {
-    if (argc < 1) {
-      return wrongArgs("mget");
+    return respEncodedArray(entries);
+  } else if (subcommand == "len" && cmd.size() == 2) {
+    return respInteger(slowlog_.size());
+  } else if (subcommand == "reset" && cmd.size() == 2) {
+    slowlog_.clear();
+    return respOk();
+  } else {
+    return respError("ERR unknown subcommand or wrong number of arguments for '" + cmd[1] + "'");
+  }
+}
+
+// DEBUG HEOPS [count] replies with the operation counts, noise budget, and
+// time per stage in microseconds of recent commands, newest first
+std::string Server::debugCommand(std::vector<std::string>& cmd) {
+  if (cmd.size() < 2) {
+    return wrongArgs("debug");
+  }
+  std::string subcommand = cmd[1];
+  for (auto &c : subcommand) {
+    c = tolower(c);
+  }
+
+  if (subcommand == "heops" && cmd.size() <= 3) {
+    size_t count = 10;
+    if (cmd.size() == 3 && !parseIndex(cmd[2], count)) {
+      return respError("ERR value is not an integer or out of range");
     }
-    std::vector<std::string> vec;
-    for (int i = 1; i < cmd.size(); i++) {
-      vec.push_back(store.get(cmd[i]));
+    std::vector<std::string> entries;
+    for (size_t i = 0; i < std::min(count, he_queries_.size()); i++) {
+      const auto& query = he_queries_[i];
+      const auto& stats = query.stats;
+      entries.push_back(respEncodedArray({
+        respInteger(query.id),
+        respBulkString(query.command),
+        respInteger(query.store_size),
+        respInteger(stats.multiplications),
+        respInteger(stats.rotations),
+        respInteger(stats.modulus_switches),
+        respInteger(stats.deserializations),
+        stats.results > 0 ? respInteger(stats.bit_capacity) : respBulkString(""),
+        respEncodedArray({
+          respBulkString("deserialize"), respInteger(stats.deserialize_usec),
+          respBulkString("subtract"), respInteger(stats.subtract_usec),
+          respBulkString("power"), respInteger(stats.power_usec),
+          respBulkString("rotate"), respInteger(stats.rotate_usec),
+          respBulkString("multiply"), respInteger(stats.multiply_usec),
+          respBulkString("accumulate"), respInteger(stats.accumulate_usec),
+          respBulkString("serialize"), respInteger(stats.serialize_usec)
+        })
+      }));
     }
-    return respArray(vec);
-  } else if (command == "flushall") {
-    if (argc != 0) {
-      return wrongArgs("flushall");
+    return respEncodedArray(entries);
+  } else if (subcommand == "timers" && cmd.size() == 2) {
+    if (!options_.he_timers) {
+      return respError("ERR HElib timers are disabled, start the server with -T");
     }
-    store.clear();
+    std::ostringstream oss;
+    helib::printAllTimers(oss);
+    return respBulkString(oss.str());
+  } else if (subcommand == "reset" && cmd.size() == 2) {
+    he_stats_ = HEStats();
+    he_commands_ = 0;
+    he_queries_.clear();
+    helib::resetAllTimers();
     return respOk();
-  } else if (command == "dbsize") {
-    if (argc != 0) {
-      return wrongArgs("dbsize");
-    }
-    // can't get unique keys
-    return respInteger(store.size());
-  } else if (command == "keys") {
-    if (argc != 1) {
-      return wrongArgs("keys");
-    }
-    if (cmd[1] != "*") {
-      return respError("ERR only '*' supported");
-    }
-    return respArray(store.keys());
-  } else if (command == "info") {
-    // sections not supported yet
-    if (argc != 0) {
-      return wrongArgs("info");
-    }
-    std::string str = "# Server\r\nmorph_version:" + std::string(MORPH_VERSION) + "\r\n";
-    return respBulkString(str);
   } else {
-    return respError("ERR unknown command '" + command + "'");
+    return respError("ERR unknown subcommand or wrong number of arguments for '" + cmd[1] + "'");
+  }
+}
+
+std::string Server::migrateCommand(std::vector<std::string>& cmd) {
+  int argc = cmd.size() - 1;
+  std::string option = argc == 5 ? cmd[5] : "";
+  for (auto &c : option) {
+    c = tolower(c);
+  }
+  if (argc != 4 && !(argc == 5 && option == "copy")) {
+    return wrongArgs("migrate");
+  }
+  // removing the entries afterwards is a write
+  if (argc == 4 && !options_.master_host.empty() && !replaying_) {
+    return respError("READONLY You can't write against a read only replica.");
+  }
+  if (migration_) {
+    return respError("ERR Migration already in progress");
+  }
+
+  int port = atoi(cmd[2].c_str());
+  size_t start, count;
+  if (port <= 0 || !parseIndex(cmd[3], start) || !parseIndex(cmd[4], count)) {
+    return respError("ERR value is not an integer or out of range");
+  }
+
+  // the event loop finishes connecting, so an unreachable target doesn't block clients
+  std::string err;
+  int fd = connStartOpen(cmd[1].c_str(), port, err);
+  if (fd == -1) {
+    return respError("IOERR error connecting to target: " + err);
+  }
+
+  size_t size = dbs_[db_]->size();
+  auto migration = std::make_unique<Migration>();
+  migration->db = db_;
+  migration->host = cmd[1];
+  migration->port = port;
+  migration->fd = fd;
+  migration->started = time(nullptr);
+  migration->next = std::min(start, size);
+  migration->end = migration->next + std::min(count, size - migration->next);
+  migration->copy = argc == 5;
+  migration->removals = removals_;
+  // entries go to the same database on the target
+  if (db_ != 0) {
+    migration->output = respArray({"select", std::to_string(db_)});
+    migration->inflight++;
+  }
+  migrate_start_ = migration->next;
+  migrate_total_ = migration->end - migration->next;
+  migration_ = std::move(migration);
+
+  std::cerr << "Migrating " << migrate_total_ << " entries to " << cmd[1] << ":" << port << std::endl;
+  return "+Migration started\r\n";
+}
+
+void Server::finishConnectMigration() {
+  std::string err;
+  if (!connFinishOpen(migration_->fd, err)) {
+    finishMigration("error connecting to target: " + err);
+    return;
+  }
+  migration_->connecting = false;
+}
+
+// called from the event loop, so both servers keep serving other clients
+void Server::migrate() {
+  auto& migration = *migration_;
+  if (migration.removals != removals_) {
+    finishMigration("entries were removed");
+    return;
+  }
+  if (migration.connecting) {
+    return;
+  }
+
+  // keep a few batches in flight to overlap serialization with the target
+  while (migration.inflight < 4 && migration.next < migration.end && migration.output.size() < 4194304) {
+    size_t count = std::min<size_t>(64, migration.end - migration.next);
+    std::vector<std::string> batch {"restore"};
+    auto args = dumpArgs(*dbs_[migration.db], migration.next, count);
+    batch.insert(batch.end(), args.begin(), args.end());
+    migration.output += respArray(batch);
+    migration.next += count;
+    migration.inflight++;
+  }
+
+  while (!migration.output.empty()) {
+    auto written = write(migration.fd, migration.output.data(), migration.output.size());
+    if (written > 0) {
+      migration.output.erase(0, written);
+    } else if (written < 0 && errno == EINTR) {
+      continue;
+    } else {
+      if (written == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        finishMigration("connection lost");
+        return;
+      }
+      break;
+    }
+  }
+
+  char buffer[65536];
+  while (true) {
+    auto bytesRead = read(migration.fd, buffer, sizeof(buffer));
+    if (bytesRead > 0) {
+      migration.input.append(buffer, bytesRead);
+    } else if (bytesRead < 0 && errno == EINTR) {
+      continue;
+    } else {
+      if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        finishMigration("connection lost");
+        return;
+      }
+      break;
+    }
+  }
+
+  while (true) {
+    auto len = replyLength(migration.input.data(), migration.input.size());
+    if (len == 0) {
+      break;
+    }
+    if (len < 0 || migration.input[0] == '-') {
+      finishMigration(len < 0 ? "bad reply" : migration.input.substr(1, migration.input.find("\r\n") - 1));
+      return;
+    }
+    migration.input.erase(0, len);
+    migration.inflight--;
+  }
+
+  if (migration.next == migration.end && migration.inflight == 0) {
+    finishMigration("");
+  }
+}
+
+void Server::finishMigration(const std::string& error) {
+  std::string target = migration_->host + ":" + std::to_string(migration_->port);
+  bool copy = migration_->copy;
+  size_t db = migration_->db;
+  close(migration_->fd);
+  migration_.reset();
+
+  if (!error.empty()) {
+    migrate_status_ = "err";
+    std::cerr << "Migration to " << target << " failed: " << error << std::endl;
+    return;
+  }
+
+  // the target has the entries now
+  if (!copy) {
+    std::vector<std::string> cmd {"delrange", std::to_string(migrate_start_), std::to_string(migrate_total_)};
+    db_ = db;
+    processCommand(cmd);
+  }
+  migrate_status_ = "ok";
+  std::cerr << "Migration to " << target << " finished" << std::endl;
+}
+
+void Server::propagate(const std::vector<std::string>& cmd) {
+  if (static_cast<long>(db_) != propagate_db_) {
+    propagate_db_ = db_;
+    propagate({"select", std::to_string(db_)});
+  }
+  if (aof_) {
+    aof_->append(cmd);
+  }
+  if (!replicas_.empty()) {
+    repl_buffer_ += respArray(cmd);
+  }
+}
+
+void Server::rewriteAppendOnlyFile() {
+  // replace the log with a snapshot of the current data
+  aof_->flush();
+  saveSnapshot(options_.aof_path, dbs_);
+  aof_->reopen();
+  propagate_db_ = -1;
+}
+
+uint64_t Server::usedMemory() {
+  uint64_t used = 0;
+  for (const auto& db : dbs_) {
+    used += db->bytes();
+  }
+  return used;
+}
+
+std::string Server::info(const std::string& section) {
+  // commandstats is only included when asked for, like Redis
+  bool all = section == "all" || section == "everything";
+  bool defaults = section == "default" || all;
+  auto include = [&](const std::string& name) {
+    return defaults || section == name;
+  };
+
+  std::vector<std::string> sections;
+
+  if (include("server")) {
+    time_t uptime = time(nullptr) - start_time_;
+    std::ostringstream oss;
+    oss << "# Server\r\n"
+      << "morph_version:" << MORPH_VERSION << "\r\n"
+      << "process_id:" << getpid() << "\r\n"
+      << "tcp_port:" << options_.port << "\r\n"
+      << "uptime_in_seconds:" << uptime << "\r\n"
+      << "uptime_in_days:" << uptime / 86400 << "\r\n";
+    sections.push_back(oss.str());
+  }
+
+  if (include("clients")) {
+    std::ostringstream oss;
+    oss << "# Clients\r\n"
+      << "connected_clients:" << connections_.size() - replicas_.size() << "\r\n";
+    sections.push_back(oss.str());
+  }
+
+  if (include("memory")) {
+    std::ostringstream oss;
+    oss << "# Memory\r\n"
+      << "used_memory_dataset:" << usedMemory() << "\r\n"
+      << "maxmemory:" << options_.maxmemory << "\r\n"
+      << "maxmemory_policy:noeviction\r\n"
+      << "storage:" << (options_.compact ? "compact" : "expanded") << "\r\n";
+    sections.push_back(oss.str());
+  }
+
+  if (include("persistence")) {
+    double current_seconds = -1;
+    double progress = 0;
+    if (child_pid_ != -1) {
+      current_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - child_start_).count();
+      uint64_t total = save_progress_->total;
+      progress = total == 0 ? 100 : 100.0 * save_progress_->saved / total;
+    }
+    std::ostringstream oss;
+    oss << "# Persistence\r\n"
+      << "rdb_changes_since_last_save:" << dirty_ << "\r\n"
+      << "rdb_bgsave_in_progress:" << (child_pid_ != -1 ? 1 : 0) << "\r\n"
+      << "rdb_last_save_time:" << lastsave_ << "\r\n"
+      << "rdb_last_bgsave_status:" << (last_bgsave_ok_ ? "ok" : "err") << "\r\n"
+      << "rdb_last_bgsave_time_sec:" << static_cast<long>(last_bgsave_seconds_) << "\r\n"
+      << "rdb_current_bgsave_time_sec:" << static_cast<long>(current_seconds) << "\r\n"
+      << "rdb_current_bgsave_progress:" << std::fixed << std::setprecision(2) << progress << "%\r\n"
+      << "rdb_current_cow_size:" << (child_pid_ != -1 ? static_cast<uint64_t>(save_progress_->cow_size) : 0) << "\r\n"
+      << "rdb_last_cow_size:" << last_cow_size_ << "\r\n"
+      << "aof_enabled:" << (aof_ ? 1 : 0) << "\r\n";
+    sections.push_back(oss.str());
+  }
+
+  if (include("stats")) {
+    std::ostringstream oss;
+    oss << "# Stats\r\n"
+      << "total_connections_received:" << total_connections_ << "\r\n"
+      << "total_commands_processed:" << total_commands_ << "\r\n"
+      << "total_net_input_bytes:" << net_input_bytes_ << "\r\n"
+      << "total_net_output_bytes:" << net_output_bytes_ << "\r\n"
+      << "expired_keys:" << expired_keys_ << "\r\n"
+      << "rejected_writes:" << rejected_writes_ << "\r\n";
+    sections.push_back(oss.str());
+  }
+
+  if (include("replication")) {
+    // same field names as Redis for tools that parse them
+    std::ostringstream oss;
+    oss << "# Replication\r\n";
+    if (options_.master_host.empty()) {
+      oss << "role:master\r\n";
+    } else {
+      oss << "role:slave\r\n"
+        << "master_host:" << options_.master_host << "\r\n"
+        << "master_port:" << options_.master_port << "\r\n"
+        << "master_link_status:" << (master_synced_ ? "up" : "down") << "\r\n"
+        << "master_sync_in_progress:" << (master_fd_ != -1 && !master_synced_ ? 1 : 0) << "\r\n";
+    }
+    oss << "connected_slaves:" << replicas_.size() << "\r\n";
+    int i = 0;
+    for (const auto& replica : replicas_) {
+      const char* states[] = {"wait_bgsave", "wait_bgsave", "send_bulk", "online"};
+      oss << "slave" << i++ << ":addr=" << connPeer(replica.first) << ",state=" << states[replica.second.state] << "\r\n";
+    }
+    sections.push_back(oss.str());
+  }
+
+  if (include("migration")) {
+    std::ostringstream oss;
+    oss << "# Migration\r\n"
+      << "migrate_in_progress:" << (migration_ ? 1 : 0) << "\r\n"
+      << "migrate_sent:" << (migration_ ? migration_->next - migrate_start_ : 0) << "\r\n"
+      << "migrate_total:" << (migration_ ? migrate_total_ : 0) << "\r\n"
+      << "migrate_last_status:" << migrate_status_ << "\r\n";
+    sections.push_back(oss.str());
+  }
+
+  if (all || section == "commandstats") {
+    std::ostringstream oss;
+    oss << "# Commandstats\r\n";
+    for (const auto& stats : command_stats_) {
+      oss << "cmdstat_" << stats.first << ":"
+        << "calls=" << stats.second.calls
+        << ",usec=" << stats.second.usec
+        << ",usec_per_call=" << std::fixed << std::setprecision(2) << static_cast<double>(stats.second.usec) / stats.second.calls
+        << "\r\n";
+    }
+    sections.push_back(oss.str());
+  }
+
+  if (include("heops")) {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(0)
+      << "# Heops\r\n"
+      << "he_timers_enabled:" << (options_.he_timers ? 1 : 0) << "\r\n"
+      << "he_commands:" << he_commands_ << "\r\n"
+      << "he_multiplications:" << he_stats_.multiplications << "\r\n"
+      << "he_rotations:" << he_stats_.rotations << "\r\n"
+      << "he_modulus_switches:" << he_stats_.modulus_switches << "\r\n"
+      << "he_deserializations:" << he_stats_.deserializations << "\r\n"
+      << "he_deserialize_usec:" << he_stats_.deserialize_usec << "\r\n"
+      << "he_subtract_usec:" << he_stats_.subtract_usec << "\r\n"
+      << "he_power_usec:" << he_stats_.power_usec << "\r\n"
+      << "he_rotate_usec:" << he_stats_.rotate_usec << "\r\n"
+      << "he_multiply_usec:" << he_stats_.multiply_usec << "\r\n"
+      << "he_accumulate_usec:" << he_stats_.accumulate_usec << "\r\n"
+      << "he_serialize_usec:" << he_stats_.serialize_usec << "\r\n"
+      << "he_results:" << he_stats_.results << "\r\n";
+    if (he_stats_.results > 0) {
+      oss << "he_min_bit_capacity:" << he_stats_.bit_capacity << "\r\n";
+    }
+    sections.push_back(oss.str());
+  }
+
+  if (include("keyspace")) {
+    std::ostringstream oss;
+    oss << "# Keyspace\r\n";
+    for (size_t i = 0; i < dbs_.size(); i++) {
+      auto& db = *dbs_[i];
+      if (db.size() > 0) {
+        oss << "db" << i << ":keys=" << db.size() << ",expires=" << db.expiring() << ",bytes=" << db.bytes() << "\r\n";
+      }
+    }
+    sections.push_back(oss.str());
+  }
+
+  std::string str;
+  for (size_t i = 0; i < sections.size(); i++) {
+    str += (i > 0 ? "\r\n" : "") + sections[i];
+  }
+  return str;
+}
+
+// private dirty memory of this process, which for a forked child
+// is the memory copied because either process wrote to it
+uint64_t privateDirtySize() {
+  std::ifstream file("/proc/self/smaps_rollup");
+  if (!file.is_open()) {
+    file.open("/proc/self/smaps");
+  }
+
+  uint64_t total = 0;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.compare(0, 14, "Private_Dirty:") == 0) {
+      total += std::strtoull(line.c_str() + 14, nullptr, 10) * 1024;
+    }
+  }
+  return total;
+}
+
+bool Server::backgroundSave() {
+  // failures count as a failed save, so cron waits before retrying
+  last_bgsave_try_ = time(nullptr);
+  if (save_progress_ == nullptr) {
+    void* map = mmap(nullptr, sizeof(SaveProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (map == MAP_FAILED) {
+      std::cerr << "Can't save in background: mmap: " << std::strerror(errno) << std::endl;
+      last_bgsave_ok_ = false;
+      return false;
+    }
+    save_progress_ = new (map) SaveProgress();
+  }
+  save_progress_->saved = 0;
+  save_progress_->total = 0;
+  for (const auto& db : dbs_) {
+    save_progress_->total += db->size();
+  }
+  save_progress_->cow_size = 0;
+
+  // write any buffered commands so the child doesn't
+  if (aof_) {
+    aof_->flush();
+  }
+  // commands from before the fork are in the snapshot
+  feedReplicas();
+  // and replicas that start from it need to know the database for the ones after
+  propagate_db_ = -1;
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    std::cerr << "Can't save in background: fork: " << std::strerror(errno) << std::endl;
+    last_bgsave_ok_ = false;
+    return false;
+  }
+
+  if (pid == 0) {
+    // the child has a copy-on-write view of the data at the time of the fork
+    int status = 0;
+    try {
+      saveSnapshot(options_.snapshot_path, dbs_, [&](size_t saved) {
+        save_progress_->saved = saved;
+        save_progress_->cow_size = privateDirtySize();
+      });
+    } catch (const std::exception& e) {
+      std::cerr << "Error saving snapshot: " << e.what() << std::endl;
+      status = 1;
+    }
+    save_progress_->cow_size = privateDirtySize();
+    // skip destructors, which belong to the parent
+    _exit(status);
+  }
+
+  std::cerr << "Background saving started by pid " << pid << std::endl;
+  child_pid_ = pid;
+  child_start_ = std::chrono::steady_clock::now();
+  // changes from now on aren't in the snapshot
+  dirty_before_bgsave_ = dirty_;
+  for (auto& replica : replicas_) {
+    if (replica.second.state == REPLICA_WAIT_BGSAVE_START) {
+      replica.second.state = REPLICA_WAIT_BGSAVE_END;
+      replica.second.pending.clear();
+    }
+  }
+  return true;
+}
+
+void Server::checkChild() {
+  int status;
+  if (child_pid_ == -1 || waitpid(child_pid_, &status, WNOHANG) != child_pid_) {
+    return;
+  }
+
+  last_bgsave_ok_ = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  last_bgsave_seconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - child_start_).count();
+  last_cow_size_ = save_progress_->cow_size;
+  child_pid_ = -1;
+
+  if (last_bgsave_ok_) {
+    dirty_ -= dirty_before_bgsave_;
+    lastsave_ = time(nullptr);
+    std::cerr << "Background saving terminated with success" << std::endl;
+  } else {
+    std::cerr << "Background saving error" << std::endl;
+  }
+
+  // start sending the snapshot to replicas waiting for it
+  for (auto& conn : connections_) {
+    auto it = replicas_.find(conn.fd);
+    if (it == replicas_.end() || it->second.state != REPLICA_WAIT_BGSAVE_END) {
+      continue;
+    }
+    auto& replica = it->second;
+
+    struct stat buf;
+    int fd = last_bgsave_ok_ ? open(options_.snapshot_path.c_str(), O_RDONLY) : -1;
+    if (fd == -1 || fstat(fd, &buf) != 0) {
+      std::cerr << "Can't send snapshot to replica " << connPeer(conn.fd) << std::endl;
+      if (fd != -1) {
+        close(fd);
+      }
+      conn.output.clear();
+      conn.closing = true;
+      continue;
+    }
+    replica.state = REPLICA_SEND_SNAPSHOT;
+    replica.snapshot_fd = fd;
+    replica.snapshot_remaining = buf.st_size;
+    conn.output += "$" + std::to_string(buf.st_size) + "\r\n";
+  }
+}
+
+// seconds to wait for a connection to the master or a migration target
+const time_t CONNECT_TIMEOUT = 10;
+
+void Server::cron() {
+  checkChild();
+
+  time_t now = time(nullptr);
+  if (!options_.master_host.empty() && master_fd_ == -1 && now - last_master_try_ >= 1) {
+    connectMaster();
+  }
+  // like a master that drops packets, which would otherwise wait for the TCP timeout
+  if (master_connecting_ && now - last_master_try_ >= CONNECT_TIMEOUT) {
+    std::cerr << "Timeout connecting to the MASTER..." << std::endl;
+    closeMaster();
+  }
+  if (migration_ && migration_->connecting && now - migration_->started >= CONNECT_TIMEOUT) {
+    finishMigration("timeout connecting to target");
+  }
+
+  // replicas wait for the master to remove entries so positions stay the same,
+  // and removing entries would abort a migration
+  if (options_.master_host.empty() && !migration_) {
+    std::vector<std::string> purge {"purge", std::to_string(unixTimeMs())};
+    processCommand(purge);
+  }
+
+  if (child_pid_ != -1) {
+    return;
+  }
+
+  // replicas that asked for a sync while another save was running,
+  // and retry failed saves less often
+  bool retry = last_bgsave_ok_ || now - last_bgsave_try_ >= 5;
+  for (const auto& replica : replicas_) {
+    if (replica.second.state == REPLICA_WAIT_BGSAVE_START && retry) {
+      backgroundSave();
+      return;
+    }
+  }
+
+  for (const auto& param : options_.save_params) {
+    if (dirty_ >= param.second && now - lastsave_ >= param.first && retry) {
+      std::cerr << param.second << " changes in " << param.first << " seconds. Saving..." << std::endl;
+      backgroundSave();
+      break;
+    }
   }
 }
 
@@ -111,53 +1453,493 @@ void Server::handleError(const std::string& section, const std::string& message)
   exit(1);
 }
 
-void Server::start() {
-  auto store = morph::Store(options_.pk_path);
+void Server::readConnection(Connection& conn) {
+  // replicas only receive, so just notice when they disconnect
+  if (replicas_.count(conn.fd)) {
+    net_input_bytes_ += readCommands(conn, [](std::vector<std::string>& cmd) {
+      return std::string();
+    });
+    return;
+  }
 
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd == -1) {
-    handleError("socket", std::strerror(errno));
+  net_input_bytes_ += readCommands(conn, [&](std::vector<std::string>& cmd) {
+    std::string command = cmd[0];
+    for (auto &c : command) {
+      c = tolower(c);
+    }
+    if (command == "sync" && cmd.size() == 1) {
+      return syncReplica(conn);
+    }
+    db_ = conn.db;
+    auto reply = call(cmd);
+    conn.db = db_;
+    return reply;
+  });
+}
+
+// full sync with a snapshot from a background save,
+// followed by the commands processed since the fork
+std::string Server::syncReplica(Connection& conn) {
+  if (replicas_.count(conn.fd)) {
+    return std::string();
   }
+  std::cerr << "Replica " << connPeer(conn.fd) << " asks for synchronization" << std::endl;
 
-  int v = 1;
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(int)) == -1) {
-    handleError("setsockopt", std::strerror(errno));
+  feedReplicas();
+  Replica replica;
+  if (child_pid_ != -1) {
+    // share a save started for another replica
+    for (const auto& other : replicas_) {
+      if (other.second.state == REPLICA_WAIT_BGSAVE_END) {
+        replica.state = REPLICA_WAIT_BGSAVE_END;
+        replica.pending = other.second.pending;
+        break;
+      }
+    }
   }
+  replicas_[conn.fd] = replica;
 
-  sockaddr_in sockaddr;
-  sockaddr.sin_family = AF_INET;
-  sockaddr.sin_addr.s_addr = inet_addr(options_.bind.c_str());
-  sockaddr.sin_port = htons(options_.port);
-  if (bind(sockfd, (struct sockaddr*)&sockaddr, sizeof(sockaddr)) < 0) {
-    handleError("bind", std::strerror(errno));
+  if (child_pid_ == -1 && !backgroundSave()) {
+    replicas_.erase(conn.fd);
+    conn.closing = true;
+    return respError("ERR Background save failed to start");
   }
+  return std::string();
+}
 
-  int max_connections = 10;
-  if (listen(sockfd, max_connections) < 0) {
-    handleError("listen", std::strerror(errno));
+void Server::feedReplicas() {
+  if (repl_buffer_.empty()) {
+    return;
+  }
+  for (auto& conn : connections_) {
+    auto it = replicas_.find(conn.fd);
+    if (it == replicas_.end() || conn.closing) {
+      continue;
+    }
+    if (it->second.state == REPLICA_ONLINE) {
+      conn.output += repl_buffer_;
+    } else if (it->second.state != REPLICA_WAIT_BGSAVE_START) {
+      it->second.pending += repl_buffer_;
+    }
   }
+  repl_buffer_.clear();
+}
 
-  std::cerr << "Ready to accept connections" << std::endl;
+void Server::sendSnapshots() {
+  for (auto& conn : connections_) {
+    auto it = replicas_.find(conn.fd);
+    // read a chunk at a time to bound memory
+    if (it == replicas_.end() || it->second.state != REPLICA_SEND_SNAPSHOT || conn.closing || conn.output.size() >= 1048576) {
+      continue;
+    }
+    auto& replica = it->second;
 
-  char buffer[1048576] = {0};
+    size_t start = conn.output.size();
+    size_t size = std::min<uint64_t>(replica.snapshot_remaining, 1048576);
+    conn.output.resize(start + size);
+    auto bytesRead = size > 0 ? read(replica.snapshot_fd, &conn.output[start], size) : 0;
+    if (bytesRead < 0 || (bytesRead == 0 && size > 0)) {
+      std::cerr << "Can't read snapshot for replica " << connPeer(conn.fd) << std::endl;
+      conn.output.clear();
+      conn.closing = true;
+      continue;
+    }
+    conn.output.resize(start + bytesRead);
+    replica.snapshot_remaining -= bytesRead;
 
-  while (1) {
-    auto addrlen = sizeof(sockaddr);
-    int connection = accept(sockfd, (struct sockaddr*)&sockaddr, (socklen_t*)&addrlen);
-    if (connection < 0) {
-      handleError("accept", std::strerror(errno));
+    if (replica.snapshot_remaining == 0) {
+      close(replica.snapshot_fd);
+      replica.snapshot_fd = -1;
+      conn.output += replica.pending;
+      replica.pending.clear();
+      replica.state = REPLICA_ONLINE;
+      std::cerr << "Synchronization with replica " << connPeer(conn.fd) << " succeeded" << std::endl;
     }
+  }
+}
+
+// replicas of a replica need to sync again when its data is replaced
+void Server::dropReplicas() {
+  for (auto& conn : connections_) {
+    if (replicas_.count(conn.fd)) {
+      conn.output.clear();
+      conn.closing = true;
+    }
+  }
+}
+
+void Server::connectMaster() {
+  last_master_try_ = time(nullptr);
+  std::cerr << "Connecting to MASTER " << options_.master_host << ":" << options_.master_port << std::endl;
+
+  // the event loop finishes connecting, so an unreachable master doesn't block clients
+  std::string err;
+  int fd = connStartOpen(options_.master_host.c_str(), options_.master_port, err);
+  if (fd == -1) {
+    std::cerr << "Error condition on socket for SYNC: " << err << std::endl;
+    return;
+  }
 
-    auto bytesRead = connRead(connection, buffer, 1048576);
+  master_fd_ = fd;
+  master_connecting_ = true;
+  master_synced_ = false;
+  master_buffer_.clear();
+  sync_remaining_ = -1;
+}
+
+void Server::finishConnectMaster() {
+  std::string err;
+  if (!connFinishOpen(master_fd_, err)) {
+    std::cerr << "Error condition on socket for SYNC: " << err << std::endl;
+    closeMaster();
+    return;
+  }
+  if (!connWrite(master_fd_, respArray({"sync"}))) {
+    std::cerr << "Error condition on socket for SYNC: " << std::strerror(errno) << std::endl;
+    closeMaster();
+    return;
+  }
+  master_connecting_ = false;
+}
+
+void Server::closeMaster() {
+  if (master_fd_ != -1) {
+    close(master_fd_);
+  }
+  if (sync_fd_ != -1) {
+    close(sync_fd_);
+    unlink((options_.snapshot_path + ".sync").c_str());
+  }
+  master_fd_ = -1;
+  master_connecting_ = false;
+  sync_fd_ = -1;
+  master_synced_ = false;
+  master_buffer_.clear();
+}
+
+void Server::readMaster() {
+  char buffer[65536];
+  while (true) {
+    auto bytesRead = read(master_fd_, buffer, sizeof(buffer));
     if (bytesRead > 0) {
-      auto arr = readArray(buffer);
-      std::string response = processCommand(arr, store);
-      send(connection, response.c_str(), response.size(), 0);
-    } else if (bytesRead == -2) {
-      std::string response = respError("Request too large for current implementation");
-      send(connection, response.c_str(), response.size(), 0);
+      master_buffer_.append(buffer, bytesRead);
+      // write the snapshot to disk as it arrives
+      if (!processMasterBuffer()) {
+        return;
+      }
+    } else if (bytesRead < 0 && errno == EINTR) {
+      continue;
+    } else {
+      if (bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        std::cerr << "Connection with master lost" << std::endl;
+        closeMaster();
+      }
+      break;
+    }
+  }
+}
+
+bool Server::processMasterBuffer() {
+  if (!master_synced_) {
+    std::string sync_path = options_.snapshot_path + ".sync";
+
+    if (sync_remaining_ < 0) {
+      auto end = master_buffer_.find("\r\n");
+      if (end == std::string::npos) {
+        return true;
+      }
+      sync_remaining_ = master_buffer_[0] == '$' ? std::atoll(master_buffer_.c_str() + 1) : -1;
+      if (sync_remaining_ < 0) {
+        std::cerr << "Bad reply to SYNC from master: " << master_buffer_.substr(0, end) << std::endl;
+        closeMaster();
+        return false;
+      }
+      master_buffer_.erase(0, end + 2);
+
+      sync_fd_ = open(sync_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (sync_fd_ == -1) {
+        std::cerr << "Can't open " << sync_path << " for sync: " << std::strerror(errno) << std::endl;
+        closeMaster();
+        return false;
+      }
+      std::cerr << "MASTER <-> REPLICA sync: receiving " << sync_remaining_ << " bytes from master" << std::endl;
+    }
+
+    size_t size = std::min<size_t>(sync_remaining_, master_buffer_.size());
+    size_t written = 0;
+    while (written < size) {
+      auto result = write(sync_fd_, master_buffer_.data() + written, size - written);
+      if (result < 0 && errno == EINTR) {
+        continue;
+      }
+      if (result <= 0) {
+        std::cerr << "Write error writing snapshot from master: " << std::strerror(errno) << std::endl;
+        closeMaster();
+        return false;
+      }
+      written += result;
+    }
+    master_buffer_.erase(0, size);
+    sync_remaining_ -= size;
+    if (sync_remaining_ > 0) {
+      return true;
+    }
+
+    bool ok = fsync(sync_fd_) == 0;
+    close(sync_fd_);
+    sync_fd_ = -1;
+    if (!ok || std::rename(sync_path.c_str(), options_.snapshot_path.c_str()) != 0) {
+      std::cerr << "Can't replace snapshot with the one from master: " << std::strerror(errno) << std::endl;
+      unlink(sync_path.c_str());
+      closeMaster();
+      return false;
+    }
+
+    try {
+      loadSnapshot(options_.snapshot_path, dbs_);
+      master_db_ = 0;
+      if (aof_) {
+        rewriteAppendOnlyFile();
+      }
+    } catch (const std::exception& e) {
+      std::cerr << "Can't load snapshot from master: " << e.what() << std::endl;
+      closeMaster();
+      return false;
+    }
+    dirty_ = 0;
+    lastsave_ = time(nullptr);
+    removals_++;
+    master_synced_ = true;
+    dropReplicas();
+    std::cerr << "MASTER <-> REPLICA sync: Finished with success" << std::endl;
+  }
+
+  // apply the stream of commands, which have no replies
+  size_t pos = 0;
+  replaying_ = true;
+  while (pos < master_buffer_.size()) {
+    std::vector<std::string> cmd;
+    auto len = readCommand(master_buffer_.data() + pos, master_buffer_.size() - pos, cmd);
+    if (len == 0) {
+      break;
+    }
+    if (len < 0) {
+      replaying_ = false;
+      std::cerr << "Protocol error from master" << std::endl;
+      closeMaster();
+      return false;
+    }
+    pos += len;
+    if (!cmd.empty()) {
+      db_ = master_db_;
+      call(cmd);
+      master_db_ = db_;
+    }
+  }
+  replaying_ = false;
+  master_buffer_.erase(0, pos);
+  return true;
+}
+
+void Server::loadAppendOnlyFile() {
+  replaying_ = true;
+
+  // batch consecutive sets to deserialize them in parallel
+  std::vector<std::pair<std::string, std::string>> pending;
+  std::vector<int64_t> pending_expires;
+  std::vector<uint32_t> pending_buckets;
+  auto flushPending = [&]() {
+    dbs_[db_]->setMany(pending, pending_expires, pending_buckets);
+    pending.clear();
+    pending_expires.clear();
+    pending_buckets.clear();
+  };
+
+  AppendOnlyFile::load(options_.aof_path, dbs_, [&](std::vector<std::string>& cmd) {
+    std::string command = cmd[0];
+    for (auto &c : command) {
+      c = tolower(c);
+    }
+
+    // expiration times are always written as PXAT
+    size_t end = cmd.size();
+    KeyOptions options;
+    bool batch = false;
+    if (command == "set" || command == "mset" || command == "restore") {
+      bool restore = command == "restore";
+      end = command == "set" ? std::min<size_t>(3, end) : optionsStart(cmd, 1);
+      batch = end >= 3 && end % 2 == 1 && parseKeyOptions(cmd, end, (end - 1) / 2, command, !restore, options, false, restore).empty();
+    }
+
+    if (batch) {
+      for (size_t i = 1; i < end; i += 2) {
+        pending.emplace_back(std::move(cmd[i]), std::move(cmd[i + 1]));
+        pending_expires.push_back(options.expires.empty() ? options.expire_at : options.expires[(i - 1) / 2]);
+        pending_buckets.push_back(options.buckets.empty() ? NO_BUCKET : options.buckets[(i - 1) / 2]);
+      }
+      if (pending.size() >= 1024) {
+        flushPending();
+      }
     } else {
-      std::cerr << "No bytes read" << std::endl;
+      flushPending();
+      processCommand(cmd);
+    }
+  });
+  flushPending();
+  replaying_ = false;
+  // new commands are appended after whatever database the file ended on
+  db_ = 0;
+  propagate_db_ = -1;
+}
+
+void Server::loadData() {
+  // the append only file has the most recent data when enabled
+  std::string path = options_.appendonly ? options_.aof_path : options_.snapshot_path;
+  if (!fileExists(path)) {
+    return;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  try {
+    if (options_.appendonly) {
+      loadAppendOnlyFile();
+    } else {
+      loadSnapshot(path, dbs_);
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cerr << "DB loaded from " << (options_.appendonly ? "append only file" : "disk") << ": " << seconds << " seconds" << std::endl;
+}
+
+void Server::start() {
+  dbs_ = createDatabases(options_.pk_path, options_.databases, options_.compact);
+  if (options_.he_timers) {
+    helib::setTimersOn();
+  }
+  loadData();
+  if (options_.warmup) {
+    auto start = std::chrono::steady_clock::now();
+    // databases share the context and key, so one is enough
+    dbs_[0]->warmUp();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << "Warm-up finished: " << seconds << " seconds" << std::endl;
+  }
+  // only count work done for clients and the master
+  for (auto& db : dbs_) {
+    db->takeStats();
+  }
+  if (options_.appendonly) {
+    aof_ = std::make_unique<AppendOnlyFile>(options_.aof_path, options_.appendfsync);
+  }
+  lastsave_ = time(nullptr);
+  start_time_ = time(nullptr);
+
+  // write errors are handled where they occur
+  signal(SIGPIPE, SIG_IGN);
+
+  std::string section;
+  int sockfd = connListen(options_.bind.c_str(), options_.port, section);
+  if (sockfd == -1) {
+    handleError(section, std::strerror(errno));
+  }
+
+  std::cerr << "Ready to accept connections" << std::endl;
+
+  auto last_cron = std::chrono::steady_clock::now();
+
+  while (1) {
+    std::vector<pollfd> fds;
+    fds.push_back({sockfd, POLLIN, 0});
+    for (const auto& conn : connections_) {
+      auto it = replicas_.find(conn.fd);
+      bool sending = it != replicas_.end() && it->second.state == REPLICA_SEND_SNAPSHOT;
+      short events = conn.output.empty() && !sending ? POLLIN : (POLLIN | POLLOUT);
+      fds.push_back({conn.fd, events, 0});
+    }
+    int master_fd = master_fd_;
+    if (master_fd != -1) {
+      fds.push_back({master_fd, static_cast<short>(master_connecting_ ? POLLOUT : POLLIN), 0});
+    }
+    // a migration started after this is polled on the next iteration
+    size_t migration_index = fds.size();
+    if (migration_) {
+      fds.push_back({migration_->fd, static_cast<short>(migration_->connecting || !migration_->output.empty() ? (POLLIN | POLLOUT) : POLLIN), 0});
+    }
+
+    // wake up for background tasks ten times a second
+    if (poll(fds.data(), fds.size(), 100) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      handleError("poll", std::strerror(errno));
+    }
+
+    if (master_fd != -1 && (fds[connections_.size() + 1].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))) {
+      if (master_connecting_) {
+        finishConnectMaster();
+      } else {
+        readMaster();
+      }
+    }
+    if (migration_ && migration_->connecting && migration_index < fds.size() && (fds[migration_index].revents & (POLLOUT | POLLHUP | POLLERR))) {
+      finishConnectMigration();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_cron >= std::chrono::milliseconds(100)) {
+      cron();
+      last_cron = now;
+    }
+
+    for (int i = 1; i <= connections_.size(); i++) {
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        readConnection(connections_[i - 1]);
+      }
+    }
+
+    if (migration_) {
+      migrate();
+    }
+
+    // group commit for all commands processed in this iteration
+    if (aof_) {
+      aof_->flush();
+    }
+    feedReplicas();
+    sendSnapshots();
+
+    for (auto& conn : connections_) {
+      net_output_bytes_ += writeConnection(conn);
+    }
+
+    connections_.erase(std::remove_if(connections_.begin(), connections_.end(), [&](const Connection& conn) {
+      if (conn.closing && conn.output.empty()) {
+        auto it = replicas_.find(conn.fd);
+        if (it != replicas_.end()) {
+          std::cerr << "Connection with replica " << connPeer(conn.fd) << " lost" << std::endl;
+          if (it->second.snapshot_fd != -1) {
+            close(it->second.snapshot_fd);
+          }
+          replicas_.erase(it);
+        }
+        close(conn.fd);
+        return true;
+      }
+      return false;
+    }), connections_.end());
+
+    if (fds[0].revents & POLLIN) {
+      int connection;
+      while ((connection = connAccept(sockfd)) >= 0) {
+        connections_.push_back({connection});
+        total_connections_++;
+      }
+      if (connection == -2) {
+        handleError("accept", std::strerror(errno));
+      }
     }
   }
 
@@ -16,16 +16,142 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <sys/types.h>
+#include <utility>
 #include <vector>
 
+#include "aof.h"
+#include "network.h"
+#include "store.h"
+
 namespace morph {
 
 struct ServerOptions {
   std::string bind = "127.0.0.1";
   int port = 6774;
   std::string pk_path = "morph.pk";
+  std::string snapshot_path = "dump.morph";
+  bool appendonly = false;
+  std::string aof_path = "appendonly.morph";
+  FSYNC_POLICY appendfsync = FSYNC_EVERYSEC;
+  // save after the given number of seconds if there were at least the given number of changes
+  std::vector<std::pair<int, int>> save_params = {{3600, 1}, {300, 100}, {60, 10000}};
+  // replicate from this server when set
+  std::string master_host;
+  int master_port = 0;
+  // log commands slower than this many microseconds, or never when negative
+  long slowlog_log_slower_than = 10000;
+  size_t slowlog_max_len = 128;
+  // number of logical databases
+  size_t databases = 16;
+  // HElib's built-in timers, which add some overhead
+  bool he_timers = false;
+  // keep entries serialized and deserialize them when scanning
+  bool compact = false;
+  // reject writes once entries use this many bytes, or 0 for no limit
+  uint64_t maxmemory = 0;
+  // run a query before accepting connections
+  bool warmup = false;
+};
+
+// shared with the background save process
+struct SaveProgress {
+  std::atomic<uint64_t> saved;
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> cow_size;
+};
+
+enum REPLICA_STATE {REPLICA_WAIT_BGSAVE_START, REPLICA_WAIT_BGSAVE_END, REPLICA_SEND_SNAPSHOT, REPLICA_ONLINE};
+
+// primary side of a replica connection
+struct Replica {
+  REPLICA_STATE state = REPLICA_WAIT_BGSAVE_START;
+  // commands since the snapshot, sent once it's transferred
+  std::string pending;
+  int snapshot_fd = -1;
+  uint64_t snapshot_remaining = 0;
+};
+
+struct CommandStats {
+  uint64_t calls = 0;
+  uint64_t usec = 0;
+  // calls that took at most 2^i microseconds
+  std::array<uint64_t, 40> histogram = {};
+};
+
+// arguments are ciphertexts, so only their count and size are kept
+struct SlowlogEntry {
+  uint64_t id;
+  time_t timestamp;
+  uint64_t usec;
+  std::string command;
+  size_t argc;
+  uint64_t bytes;
+  size_t store_size;
+};
+
+// homomorphic work done by a command
+struct HEQuery {
+  uint64_t id;
+  std::string command;
+  size_t store_size;
+  HEStats stats;
+};
+
+enum COMMAND_FLAGS {
+  // changes data, so replicas reject it
+  CMD_WRITE = 1,
+  CMD_READONLY = 2,
+  CMD_ADMIN = 4,
+  // constant time
+  CMD_FAST = 8,
+  // runs the equality kernel against entries, the most expensive class
+  CMD_HOMOMORPHIC = 16,
+  // adds entries, so it's rejected over maxmemory
+  CMD_DENYOOM = 32,
+  // only from the master, the append only file, and cron, so clients get an unknown command error
+  CMD_INTERNAL = 64
+};
+
+class Server;
+
+struct Command {
+  const char* name;
+  // number of arguments including the name, or the negative of the minimum
+  int arity;
+  int flags;
+  int first_key;
+  int last_key;
+  int step;
+  std::string (Server::*proc)(std::vector<std::string>& cmd);
+};
+
+// copies a range of entries to another server a batch at a time
+struct Migration {
+  std::string host;
+  int port;
+  int fd = -1;
+  // waiting for a non-blocking connect to finish, which started at this time
+  bool connecting = true;
+  time_t started;
+  size_t db;
+  size_t next;
+  size_t end;
+  bool copy;
+  // the range is only valid while nothing is removed
+  uint64_t removals;
+  int inflight = 0;
+  std::string input;
+  std::string output;
 };
 
 class Server {
@@ -36,10 +162,133 @@ class Server {
     }
     void start();
 
+    // every command, which dispatch, stats, and COMMAND use
+    static const Command COMMANDS[];
+
   private:
     ServerOptions options_;
+    Databases dbs_;
+    // database of the command being processed
+    size_t db_ = 0;
+    // database of the append only file and replica stream, or -1 to select one first
+    long propagate_db_ = -1;
+    std::unique_ptr<AppendOnlyFile> aof_;
+    std::vector<Connection> connections_;
+
+    // stats
+    time_t start_time_ = 0;
+    uint64_t total_connections_ = 0;
+    uint64_t total_commands_ = 0;
+    uint64_t net_input_bytes_ = 0;
+    uint64_t net_output_bytes_ = 0;
+    uint64_t expired_keys_ = 0;
+    uint64_t rejected_writes_ = 0;
+    std::map<std::string, CommandStats> command_stats_;
+    // newest first
+    std::deque<SlowlogEntry> slowlog_;
+    uint64_t slowlog_id_ = 0;
+    HEStats he_stats_;
+    uint64_t he_commands_ = 0;
+    // newest first
+    std::deque<HEQuery> he_queries_;
+    uint64_t he_query_id_ = 0;
+
+    // persistence
+    long dirty_ = 0;
+    long dirty_before_bgsave_ = 0;
+    time_t lastsave_ = 0;
+    time_t last_bgsave_try_ = 0;
+    pid_t child_pid_ = -1;
+    std::chrono::steady_clock::time_point child_start_;
+    SaveProgress* save_progress_ = nullptr;
+    bool last_bgsave_ok_ = true;
+    double last_bgsave_seconds_ = -1;
+    uint64_t last_cow_size_ = 0;
+
+    // replication
+    std::map<int, Replica> replicas_;
+    // commands to send to replicas
+    std::string repl_buffer_;
+    // applying commands from the master or the append only file
+    bool replaying_ = false;
+    int master_fd_ = -1;
+    // waiting for a non-blocking connect to finish
+    bool master_connecting_ = false;
+    size_t master_db_ = 0;
+    bool master_synced_ = false;
+    std::string master_buffer_;
+    long long sync_remaining_ = -1;
+    int sync_fd_ = -1;
+    time_t last_master_try_ = 0;
+
+    // migration
+    std::unique_ptr<Migration> migration_;
+    // changes when entries are removed, which shifts positions
+    uint64_t removals_ = 0;
+    size_t migrate_start_ = 0;
+    size_t migrate_total_ = 0;
+    std::string migrate_status_ = "ok";
 
     void handleError(const std::string& section, const std::string& message);
+    void loadData();
+    void loadAppendOnlyFile();
+    std::string processCommand(std::vector<std::string>& cmd);
+    // processes a command and records stats
+    std::string call(std::vector<std::string>& cmd);
+    // case-insensitive perfect hash lookup, or nullptr when unknown
+    const Command* lookupCommand(const std::string& name);
+    // checks arity and replica writes, then runs the command
+    std::string dispatch(const Command& command, std::vector<std::string>& cmd);
+    std::string setCommand(std::vector<std::string>& cmd);
+    std::string setexCommand(std::vector<std::string>& cmd);
+    std::string msetCommand(std::vector<std::string>& cmd);
+    std::string getCommand(std::vector<std::string>& cmd);
+    std::string mgetCommand(std::vector<std::string>& cmd);
+    std::string existsCommand(std::vector<std::string>& cmd);
+    std::string flushallCommand(std::vector<std::string>& cmd);
+    std::string flushdbCommand(std::vector<std::string>& cmd);
+    std::string selectCommand(std::vector<std::string>& cmd);
+    std::string dumpCommand(std::vector<std::string>& cmd);
+    std::string restoreCommand(std::vector<std::string>& cmd);
+    std::string delrangeCommand(std::vector<std::string>& cmd);
+    std::string purgeCommand(std::vector<std::string>& cmd);
+    std::string migrateCommand(std::vector<std::string>& cmd);
+    std::string dbsizeCommand(std::vector<std::string>& cmd);
+    std::string keysCommand(std::vector<std::string>& cmd);
+    std::string scanCommand(std::vector<std::string>& cmd);
+    std::string saveCommand(std::vector<std::string>& cmd);
+    std::string bgsaveCommand(std::vector<std::string>& cmd);
+    std::string lastsaveCommand(std::vector<std::string>& cmd);
+    std::string rewriteaofCommand(std::vector<std::string>& cmd);
+    std::string replicaofCommand(std::vector<std::string>& cmd);
+    std::string infoCommand(std::vector<std::string>& cmd);
+    std::string latencyCommand(std::vector<std::string>& cmd);
+    std::string slowlogCommand(std::vector<std::string>& cmd);
+    std::string debugCommand(std::vector<std::string>& cmd);
+    std::string commandCommand(std::vector<std::string>& cmd);
+    void propagate(const std::vector<std::string>& cmd);
+    void rewriteAppendOnlyFile();
+    bool backgroundSave();
+    void checkChild();
+    void cron();
+    std::string info(const std::string& section);
+    // serialized size of entries in every database, which maxmemory limits
+    uint64_t usedMemory();
+    void readConnection(Connection& conn);
+    std::string syncReplica(Connection& conn);
+    void feedReplicas();
+    void sendSnapshots();
+    void dropReplicas();
+    void connectMaster();
+    // called when the connection is writable
+    void finishConnectMaster();
+    void closeMaster();
+    void readMaster();
+    bool processMasterBuffer();
+    // called when the connection is writable
+    void finishConnectMigration();
+    void migrate();
+    void finishMigration(const std::string& status);
 };
 
 } // namespace morph
@@ -15,77 +15,841 @@
  * limitations under the License. See accompanying LICENSE file.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <streambuf>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <utility>
 #include <vector>
 
 #include <helib/helib.h>
 
+#include "parallel.h"
 #include "store.h"
 
 namespace morph {
 
+void slotsEqual(helib::Ctxt& diff, long p) {
+  // Fermat's little theorem: x^(p-1) is 0 for x = 0 and 1 otherwise
+  diff.power(p - 1);
+  diff.negate();
+  diff.addConstant(NTL::ZZX(1));
+}
+
+void allSlots(helib::Ctxt& mask, const helib::EncryptedArray& ea) {
+  std::vector<helib::Ctxt> rotated_masks(ea.size(), mask);
+  for (int i = 1; i < rotated_masks.size(); i++) {
+    ea.rotate(rotated_masks[i], i);
+  }
+  totalProduct(mask, rotated_masks);
+}
+
+int64_t unixTimeMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void HEStats::add(const HEStats& other) {
+  multiplications += other.multiplications;
+  rotations += other.rotations;
+  modulus_switches += other.modulus_switches;
+  deserializations += other.deserializations;
+  deserialize_usec += other.deserialize_usec;
+  subtract_usec += other.subtract_usec;
+  power_usec += other.power_usec;
+  rotate_usec += other.rotate_usec;
+  multiply_usec += other.multiply_usec;
+  accumulate_usec += other.accumulate_usec;
+  serialize_usec += other.serialize_usec;
+  if (other.results > 0 && (results == 0 || other.bit_capacity < bit_capacity)) {
+    bit_capacity = other.bit_capacity;
+  }
+  results += other.results;
+}
+
+// microseconds since start, and resets start for the next stage
+double lap(std::chrono::steady_clock::time_point& start) {
+  auto now = std::chrono::steady_clock::now();
+  double usec = std::chrono::duration<double, std::micro>(now - start).count();
+  start = now;
+  return usec;
+}
+
+// Ctxt::power uses repeated squaring
+uint64_t powerMultiplications(long e) {
+  long bits = 64 - __builtin_clzll(e);
+  return (bits - 1) + (__builtin_popcountll(e) - 1);
+}
+
+class MemoryBuffer : public std::streambuf {
+  public:
+    MemoryBuffer(const char* data, size_t size) {
+      auto p = const_cast<char*>(data);
+      setg(p, p, p + size);
+    }
+};
+
 helib::Ctxt Store::stringToCtxt(const std::string& str) {
   std::istringstream iss(str);
   return helib::Ctxt::readFrom(iss, *pkp_.get());
 }
 
-void Store::set(const std::string& key, const std::string& value) {
+Chunks Store::stringToChunks(const std::string& str) {
+  std::istringstream iss(str);
+  return readChunks(iss, *pkp_.get());
+}
+
+void Store::set(const std::string& key, const std::string& value, int64_t expire_at, uint32_t bucket) {
+  auto start = std::chrono::steady_clock::now();
   auto encrypted_key = stringToCtxt(key);
-  auto encrypted_value = stringToCtxt(value);
-  store_.emplace_back(std::move(encrypted_key), std::move(encrypted_value));
+  auto encrypted_value = stringToChunks(value);
+  stats_.deserializations += 1 + encrypted_value.size();
+  stats_.deserialize_usec += lap(start);
+  // deserialized either way so invalid data is rejected
+  if (compact_) {
+    append(key, value);
+  } else {
+    store_.emplace_back(std::move(encrypted_key), std::move(encrypted_value));
+  }
+  sizes_.push_back(key.size() + value.size());
+  bytes_ += sizes_.back();
+  addExpire(expire_at);
+  addBucket(bucket);
 }
 
-std::string Store::get(const std::string& key) {
-  if (store_.size() == 0) {
-    return "";
+void Store::append(const std::string& key, const std::string& value) {
+  offsets_.push_back(arena_.size());
+  key_sizes_.push_back(key.size());
+  arena_ += key;
+  arena_ += value;
+}
+
+std::string Store::serialized(size_t i, bool key) {
+  if (compact_) {
+    return key ? arena_.substr(offsets_[i], key_sizes_[i]) : arena_.substr(offsets_[i] + key_sizes_[i], sizes_[i] - key_sizes_[i]);
   }
+  return key ? ctxtToString(store_[i].first) : chunksToString(store_[i].second);
+}
 
-  auto encrypted_key = stringToCtxt(key);
+void Store::forEachEntry(const std::vector<size_t>& positions, bool values, std::chrono::steady_clock::time_point& start,
+    const std::function<void(size_t, const helib::Ctxt&, const Chunks&)>& fn) {
+  int64_t now = expiring_ > 0 ? unixTimeMs() : 0;
+  std::vector<size_t> live;
+  live.reserve(positions.size());
+  for (size_t i : positions) {
+    if (expires_[i] == 0 || expires_[i] > now) {
+      live.push_back(i);
+    }
+  }
+
+  if (!compact_) {
+    for (size_t i : live) {
+      fn(i, store_[i].first, store_[i].second);
+    }
+    return;
+  }
+
+  // bounds memory to a chunk of expanded entries
+  size_t chunk_size = 64;
+  size_t parts = values ? 2 : 1;
+  std::vector<std::pair<helib::Ctxt, Chunks>> chunk;
+  for (size_t c = 0; c < live.size(); c += chunk_size) {
+    size_t n = std::min(chunk_size, live.size() - c);
+    chunk.assign(n, {helib::Ctxt(*pkp_), Chunks()});
+    parallelFor(n * parts, [&](size_t i) {
+      size_t e = live[c + i / parts];
+      bool key = i % parts == 0;
+      const char* data = arena_.data() + offsets_[e] + (key ? 0 : key_sizes_[e]);
+      MemoryBuffer mem(data, key ? key_sizes_[e] : sizes_[e] - key_sizes_[e]);
+      std::istream is(&mem);
+      if (key) {
+        chunk[i / parts].first = helib::Ctxt::readFrom(is, *pkp_.get());
+      } else {
+        chunk[i / parts].second = readChunks(is, *pkp_.get());
+      }
+    });
+    stats_.deserializations += n;
+    for (const auto& entry : chunk) {
+      stats_.deserializations += entry.second.size();
+    }
+    stats_.deserialize_usec += lap(start);
+    for (size_t i = 0; i < n; i++) {
+      fn(live[c + i], chunk[i].first, chunk[i].second);
+    }
+  }
+}
+
+helib::Ctxt Store::keyMask(const helib::Ctxt& stored_key, const helib::Ctxt& key, std::chrono::steady_clock::time_point& start) {
   const helib::EncryptedArray& ea = contextp_->getEA();
   long p = contextp_->getP();
 
-  std::vector<helib::Ctxt> mask;
-  mask.reserve(store_.size());
-  for (const auto& encrypted_pair : store_) {
-    helib::Ctxt mask_entry = encrypted_pair.first;
-    mask_entry -= encrypted_key;
-    mask_entry.power(p - 1);
-    mask_entry.negate();
-    mask_entry.addConstant(NTL::ZZX(1));
-    std::vector<helib::Ctxt> rotated_masks(ea.size(), mask_entry);
-    for (int i = 1; i < rotated_masks.size(); i++) {
-      ea.rotate(rotated_masks[i], i);
+  helib::Ctxt mask = stored_key;
+  mask -= key;
+  stats_.subtract_usec += lap(start);
+  slotsEqual(mask, p);
+  stats_.power_usec += lap(start);
+  allSlots(mask, ea);
+  stats_.rotate_usec += lap(start);
+  // power, then the total product of the rotations
+  stats_.multiplications += powerMultiplications(p - 1) + (ea.size() - 1);
+  stats_.rotations += ea.size() - 1;
+  return mask;
+}
+
+std::string Store::serializeResult(const helib::Ctxt& value, std::chrono::steady_clock::time_point& start) {
+  std::string str = ctxtToString(value);
+  stats_.serialize_usec += lap(start);
+  HEStats result;
+  result.results = 1;
+  result.bit_capacity = value.bitCapacity();
+  stats_.add(result);
+  return str;
+}
+
+std::vector<helib::Ctxt> Store::parseKeys(const std::vector<std::string>& keys, std::chrono::steady_clock::time_point& start) {
+  std::vector<helib::Ctxt> encrypted_keys(keys.size(), helib::Ctxt(*pkp_));
+  parallelFor(keys.size(), [&](size_t i) {
+    encrypted_keys[i] = stringToCtxt(keys[i]);
+  });
+  stats_.deserializations += keys.size();
+  stats_.deserialize_usec += lap(start);
+  return encrypted_keys;
+}
+
+std::vector<Chunks> Store::lookup(const std::vector<helib::Ctxt>& keys, const std::vector<uint32_t>& buckets, std::chrono::steady_clock::time_point& start) {
+  std::vector<Chunks> values(keys.size());
+  // each entry is expanded once and compared with every key
+  forEachEntry(candidates(buckets), true, start, [&](size_t e, const helib::Ctxt& stored_key, const Chunks& stored_value) {
+    for (size_t k = 0; k < keys.size(); k++) {
+      if (!buckets.empty() && !inBucket(e, buckets[k])) {
+        continue;
+      }
+      // the mask is computed once and multiplied into every chunk
+      helib::Ctxt mask = keyMask(stored_key, keys[k], start);
+      Chunks masked(stored_value.size(), mask);
+      parallelFor(masked.size(), [&](size_t i) {
+        masked[i].multiplyBy(stored_value[i]);
+      });
+      stats_.multiply_usec += lap(start);
+      stats_.multiplications += masked.size();
+      stats_.modulus_switches += stored_key.getPrimeSet().card() - masked[0].getPrimeSet().card();
+      // entries with fewer chunks add nothing to the rest
+      auto& value = values[k];
+      for (size_t i = 0; i < masked.size(); i++) {
+        if (i < value.size()) {
+          value[i] += masked[i];
+        } else {
+          value.push_back(std::move(masked[i]));
+        }
+      }
+      stats_.accumulate_usec += lap(start);
     }
-    totalProduct(mask_entry, rotated_masks);
-    mask_entry.multiplyBy(encrypted_pair.second);
-    mask.push_back(mask_entry);
+  });
+  return values;
+}
+
+std::string Store::get(const std::string& key, uint32_t bucket) {
+  return getMany({key}, {bucket})[0];
+}
+
+std::vector<std::string> Store::getMany(const std::vector<std::string>& keys, const std::vector<uint32_t>& buckets) {
+  std::vector<std::string> results(keys.size());
+  if (sizes_.empty()) {
+    return results;
   }
 
-  helib::Ctxt value = mask[0];
-  for (int i = 1; i < mask.size(); i++) {
-    value += mask[i];
+  auto start = std::chrono::steady_clock::now();
+  auto values = lookup(parseKeys(keys, start), buckets, start);
+  // serialized a chunk at a time, one after another
+  for (size_t k = 0; k < keys.size(); k++) {
+    for (const auto& chunk : values[k]) {
+      results[k] += serializeResult(chunk, start);
+    }
+  }
+  return results;
+}
+
+std::vector<std::string> Store::getPacked(const std::vector<std::string>& keys, const std::vector<uint32_t>& buckets, size_t width) {
+  const helib::EncryptedArray& ea = contextp_->getEA();
+  size_t per = ea.size() / width;
+  std::vector<std::string> results;
+  if (sizes_.empty()) {
+    results.resize((keys.size() + per - 1) / per);
+    return results;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto values = lookup(parseKeys(keys, start), buckets, start);
+
+  // 1 in the first width slots, so longer values can't spill into the next range
+  std::vector<long> window(ea.size(), 0);
+  std::fill(window.begin(), window.begin() + width, 1);
+  NTL::ZZX window_poly;
+  ea.encode(window_poly, window);
+
+  std::unique_ptr<helib::Ctxt> packed;
+  for (size_t k = 0; k < keys.size(); k++) {
+    // values longer than one chunk don't fit anyway
+    auto& chunks = values[k];
+    std::unique_ptr<helib::Ctxt> value;
+    if (!chunks.empty()) {
+      value = std::make_unique<helib::Ctxt>(std::move(chunks[0]));
+    }
+    size_t offset = (k % per) * width;
+    if (value) {
+      value->multByConstant(window_poly);
+      if (offset > 0) {
+        ea.rotate(*value, offset);
+        stats_.rotations++;
+      }
+      stats_.rotate_usec += lap(start);
+      if (packed) {
+        *packed += *value;
+      } else {
+        packed = std::move(value);
+      }
+      stats_.accumulate_usec += lap(start);
+    }
+    if (k % per == per - 1 || k == keys.size() - 1) {
+      results.push_back(packed ? serializeResult(*packed, start) : "");
+      packed.reset();
+    }
+  }
+  return results;
+}
+
+std::string Store::exists(const std::vector<std::string>& keys, const std::vector<uint32_t>& buckets) {
+  if (sizes_.empty()) {
+    return "";
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto encrypted_keys = parseKeys(keys, start);
+
+  // the masks are 1 for each match, so their sum is the count
+  // each entry is expanded once and compared with every key
+  std::unique_ptr<helib::Ctxt> count;
+  forEachEntry(candidates(buckets), false, start, [&](size_t e, const helib::Ctxt& stored_key, const Chunks&) {
+    for (size_t k = 0; k < encrypted_keys.size(); k++) {
+      if (!buckets.empty() && !inBucket(e, buckets[k])) {
+        continue;
+      }
+      helib::Ctxt mask = keyMask(stored_key, encrypted_keys[k], start);
+      stats_.modulus_switches += stored_key.getPrimeSet().card() - mask.getPrimeSet().card();
+      if (count) {
+        *count += mask;
+      } else {
+        count = std::make_unique<helib::Ctxt>(mask);
+      }
+      stats_.accumulate_usec += lap(start);
+    }
+  });
+  if (!count) {
+    return "";
+  }
+  return serializeResult(*count, start);
+}
+
+void Store::setMany(const std::vector<std::pair<std::string, std::string>>& pairs, const std::vector<int64_t>& expires, const std::vector<uint32_t>& buckets) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::pair<helib::Ctxt, Chunks>> entries(pairs.size(), {helib::Ctxt(*pkp_), Chunks()});
+  parallelFor(pairs.size() * 2, [&](size_t i) {
+    if (i % 2 == 0) {
+      entries[i / 2].first = stringToCtxt(pairs[i / 2].first);
+    } else {
+      entries[i / 2].second = stringToChunks(pairs[i / 2].second);
+    }
+  });
+  stats_.deserializations += pairs.size();
+  for (const auto& entry : entries) {
+    stats_.deserializations += entry.second.size();
+  }
+  stats_.deserialize_usec += lap(start);
+
+  if (compact_) {
+    for (const auto& pair : pairs) {
+      append(pair.first, pair.second);
+    }
+  } else {
+    store_.reserve(store_.size() + entries.size());
+    for (auto& entry : entries) {
+      store_.push_back(std::move(entry));
+    }
+  }
+  for (size_t i = 0; i < pairs.size(); i++) {
+    sizes_.push_back(pairs[i].first.size() + pairs[i].second.size());
+    bytes_ += sizes_.back();
+    addExpire(expires.empty() ? 0 : expires[i]);
+    addBucket(buckets.empty() ? NO_BUCKET : buckets[i]);
   }
-  return ctxtToString(value);
 }
 
 void Store::clear() {
   store_.clear();
+  arena_.clear();
+  offsets_.clear();
+  key_sizes_.clear();
+  sizes_.clear();
+  bytes_ = 0;
+  expires_.clear();
+  expiring_ = 0;
+  next_expire_ = 0;
+  buckets_.clear();
+  index_.clear();
 }
 
 std::vector<std::string> Store::keys() {
-  std::vector<std::string> keys;
-  for (const auto& v : store_) {
-    keys.push_back(ctxtToString(v.first));
-  }
+  return keys(0, sizes_.size());
+}
+
+std::vector<std::string> Store::keys(size_t start, size_t count) {
+  start = std::min(start, sizes_.size());
+  count = std::min(count, sizes_.size() - start);
+  std::vector<std::string> keys(count);
+  parallelFor(count, [&](size_t i) {
+    keys[i] = serialized(start + i, true);
+  });
   return keys;
 }
 
 int Store::size() {
-  return store_.size();
+  return sizes_.size();
+}
+
+uint64_t Store::bytes() {
+  return bytes_;
+}
+
+bool Store::compact() {
+  return compact_;
+}
+
+size_t Store::slots() {
+  return contextp_->getEA().size();
+}
+
+void Store::warmUp() {
+  auto start = std::chrono::steady_clock::now();
+  helib::Ptxt<helib::BGV> plaintext(*contextp_);
+  helib::Ctxt ctxt(*pkp_);
+  pkp_->Encrypt(ctxt, plaintext);
+  helib::Ctxt mask = keyMask(ctxt, ctxt, start);
+  mask.multiplyBy(ctxt);
+  ctxtToString(mask);
+  stats_ = HEStats();
+}
+
+HEStats Store::takeStats() {
+  HEStats stats = stats_;
+  stats_ = HEStats();
+  return stats;
+}
+
+std::vector<std::string> Store::dump(size_t start, size_t count, std::vector<int64_t>& expires, std::vector<uint32_t>& buckets) {
+  start = std::min(start, sizes_.size());
+  count = std::min(count, sizes_.size() - start);
+  std::vector<std::string> values(count * 2);
+  parallelFor(count * 2, [&](size_t i) {
+    values[i] = serialized(start + i / 2, i % 2 == 0);
+  });
+  expires.assign(expires_.begin() + start, expires_.begin() + start + count);
+  buckets.assign(buckets_.begin() + start, buckets_.begin() + start + count);
+  return values;
+}
+
+void Store::erase(size_t start, size_t count) {
+  start = std::min(start, sizes_.size());
+  count = std::min(count, sizes_.size() - start);
+  if (compact_) {
+    uint64_t from = start < offsets_.size() ? offsets_[start] : arena_.size();
+    uint64_t to = start + count < offsets_.size() ? offsets_[start + count] : arena_.size();
+    arena_.erase(from, to - from);
+    offsets_.erase(offsets_.begin() + start, offsets_.begin() + start + count);
+    key_sizes_.erase(key_sizes_.begin() + start, key_sizes_.begin() + start + count);
+    for (size_t i = start; i < offsets_.size(); i++) {
+      offsets_[i] -= to - from;
+    }
+  } else {
+    store_.erase(store_.begin() + start, store_.begin() + start + count);
+  }
+  for (size_t i = start; i < start + count; i++) {
+    bytes_ -= sizes_[i];
+  }
+  sizes_.erase(sizes_.begin() + start, sizes_.begin() + start + count);
+  expiring_ -= std::count_if(expires_.begin() + start, expires_.begin() + start + count, [](int64_t t) { return t != 0; });
+  expires_.erase(expires_.begin() + start, expires_.begin() + start + count);
+  buckets_.erase(buckets_.begin() + start, buckets_.begin() + start + count);
+  rebuildIndex();
+}
+
+void Store::addExpire(int64_t expire_at) {
+  expires_.push_back(expire_at);
+  if (expire_at != 0) {
+    expiring_++;
+    if (next_expire_ == 0 || expire_at < next_expire_) {
+      next_expire_ = expire_at;
+    }
+  }
+}
+
+void Store::addBucket(uint32_t bucket) {
+  buckets_.push_back(bucket);
+  index_[bucket].push_back(buckets_.size() - 1);
+}
+
+void Store::rebuildIndex() {
+  index_.clear();
+  for (size_t i = 0; i < buckets_.size(); i++) {
+    index_[buckets_[i]].push_back(i);
+  }
+}
+
+std::vector<size_t> Store::candidates(const std::vector<uint32_t>& buckets) {
+  std::vector<size_t> positions;
+  if (buckets.empty() || std::count(buckets.begin(), buckets.end(), NO_BUCKET) > 0) {
+    positions.resize(sizes_.size());
+    std::iota(positions.begin(), positions.end(), 0);
+    return positions;
+  }
+  std::vector<uint32_t> scanned(buckets);
+  scanned.push_back(NO_BUCKET);
+  std::sort(scanned.begin(), scanned.end());
+  scanned.erase(std::unique(scanned.begin(), scanned.end()), scanned.end());
+  for (uint32_t b : scanned) {
+    auto it = index_.find(b);
+    if (it != index_.end()) {
+      positions.insert(positions.end(), it->second.begin(), it->second.end());
+    }
+  }
+  // in order, so compact entries are read front to back
+  std::sort(positions.begin(), positions.end());
+  return positions;
+}
+
+bool Store::inBucket(size_t i, uint32_t bucket) {
+  return bucket == NO_BUCKET || buckets_[i] == bucket || buckets_[i] == NO_BUCKET;
+}
+
+size_t Store::expire(int64_t now) {
+  if (expiring_ == 0 || next_expire_ > now) {
+    return 0;
+  }
+
+  // compact in place to keep the order of the remaining entries
+  size_t kept = 0;
+  uint64_t arena_size = 0;
+  size_t count = sizes_.size();
+  next_expire_ = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (expires_[i] != 0 && expires_[i] <= now) {
+      bytes_ -= sizes_[i];
+      expiring_--;
+      continue;
+    }
+    if (expires_[i] != 0 && (next_expire_ == 0 || expires_[i] < next_expire_)) {
+      next_expire_ = expires_[i];
+    }
+    if (compact_) {
+      // entries are in order, so this only moves them toward the front
+      if (offsets_[i] != arena_size) {
+        std::memmove(&arena_[arena_size], &arena_[offsets_[i]], sizes_[i]);
+      }
+      offsets_[kept] = arena_size;
+      key_sizes_[kept] = key_sizes_[i];
+      arena_size += sizes_[i];
+    }
+    if (kept != i) {
+      if (!compact_) {
+        store_[kept] = std::move(store_[i]);
+      }
+      sizes_[kept] = sizes_[i];
+      expires_[kept] = expires_[i];
+      buckets_[kept] = buckets_[i];
+    }
+    kept++;
+  }
+  size_t removed = count - kept;
+  if (compact_) {
+    arena_.resize(arena_size);
+    offsets_.resize(kept);
+    key_sizes_.resize(kept);
+  } else {
+    store_.erase(store_.begin() + kept, store_.end());
+  }
+  sizes_.resize(kept);
+  expires_.resize(kept);
+  buckets_.resize(kept);
+  rebuildIndex();
+  return removed;
+}
+
+size_t Store::expiring() {
+  return expiring_;
+}
+
+// snapshot layout, with integers in host byte order
+// header, then key and value ciphertexts, then an entry table with offsets
+// so entries can be read directly from a memory-mapped file,
+// then expiration times (added in version 2)
+// version 3 has a section like this for each database with entries
+// then bucket tags (added in version 4)
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  // database number, added in version 3
+  uint32_t db;
+  uint64_t fingerprint;
+  uint64_t count;
+  uint64_t table_offset;
+};
+
+struct SnapshotEntry {
+  uint64_t key_offset;
+  uint64_t key_size;
+  uint64_t value_offset;
+  uint64_t value_size;
+};
+
+const char SNAPSHOT_MAGIC[8] = {'M', 'O', 'R', 'P', 'H', 'S', 'N', 'P'};
+const uint32_t SNAPSHOT_VERSION = 4;
+
+void Store::write(std::ostream& file, uint32_t db, const std::function<void(size_t)>& progress) {
+  // offsets are from the start of the section
+  auto section_start = file.tellp();
+
+  SnapshotHeader header = {};
+  std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.db = db;
+  header.fingerprint = fingerprint_;
+  header.count = sizes_.size();
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  // serialize in parallel a chunk at a time to bound memory
+  std::vector<SnapshotEntry> table;
+  table.reserve(sizes_.size());
+  uint64_t offset = sizeof(header);
+  size_t chunk_size = 256;
+  std::vector<std::string> chunk;
+  for (size_t start = 0; start < sizes_.size(); start += chunk_size) {
+    size_t n = std::min(chunk_size, sizes_.size() - start);
+    chunk.assign(n * 2, "");
+    parallelFor(n * 2, [&](size_t i) {
+      chunk[i] = serialized(start + i / 2, i % 2 == 0);
+    });
+    for (size_t i = 0; i < n; i++) {
+      const auto& key = chunk[i * 2];
+      const auto& value = chunk[i * 2 + 1];
+      table.push_back({offset, key.size(), offset + key.size(), value.size()});
+      file.write(key.data(), key.size());
+      file.write(value.data(), value.size());
+      offset += key.size() + value.size();
+    }
+    if (progress) {
+      progress(start + n);
+    }
+  }
+
+  file.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotEntry));
+  file.write(reinterpret_cast<const char*>(expires_.data()), expires_.size() * sizeof(int64_t));
+  file.write(reinterpret_cast<const char*>(buckets_.data()), buckets_.size() * sizeof(uint32_t));
+  header.table_offset = offset;
+  file.seekp(section_start);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.seekp(0, std::ios::end);
+}
+
+void saveSnapshot(const std::string& path, const Databases& dbs, const std::function<void(size_t)>& progress) {
+  std::string tmp_path = path + ".tmp";
+  std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open()) {
+    throw std::runtime_error("Error opening file: " + tmp_path);
+  }
+
+  // the first database is always written so the file starts with a header
+  size_t saved = 0;
+  for (size_t db = 0; db < dbs.size(); db++) {
+    if (db > 0 && dbs[db]->size() == 0) {
+      continue;
+    }
+    dbs[db]->write(file, db, [&](size_t n) {
+      if (progress) {
+        progress(saved + n);
+      }
+    });
+    saved += dbs[db]->size();
+  }
+  file.close();
+  if (!file) {
+    throw std::runtime_error("Error writing file: " + tmp_path);
+  }
+
+  // make sure data is on disk before replacing the previous snapshot
+  int fd = open(tmp_path.c_str(), O_RDONLY);
+  if (fd == -1 || fsync(fd) != 0) {
+    if (fd != -1) {
+      close(fd);
+    }
+    throw std::runtime_error("Error syncing file: " + tmp_path);
+  }
+  close(fd);
+
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("Error renaming file: " + tmp_path);
+  }
+}
+
+bool Store::isSnapshot(const char* data, size_t size) {
+  return size >= sizeof(SNAPSHOT_MAGIC) && std::memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+}
+
+void loadSnapshot(const std::string& path, Databases& dbs) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Error opening file: " + path);
+  }
+
+  struct stat buf;
+  if (fstat(fd, &buf) != 0 || buf.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("Bad snapshot: " + path);
+  }
+  size_t size = buf.st_size;
+
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    throw std::runtime_error("Error mapping file: " + path);
+  }
+
+  try {
+    loadSnapshot(static_cast<const char*>(map), size, dbs);
+  } catch (...) {
+    munmap(map, size);
+    throw;
+  }
+  munmap(map, size);
+}
+
+size_t Store::load(const char* data, size_t size) {
+  SnapshotHeader header;
+  if (size < sizeof(header)) {
+    throw std::runtime_error("Bad snapshot");
+  }
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version < 1 || header.version > SNAPSHOT_VERSION) {
+    throw std::runtime_error("Bad snapshot");
+  }
+  if (header.fingerprint != fingerprint_) {
+    throw std::runtime_error("Snapshot was created with a different key");
+  }
+  // version 1 has no expiration times, and earlier versions have no bucket tags
+  size_t entry_size = sizeof(SnapshotEntry) + (header.version >= 2 ? sizeof(int64_t) : 0) + (header.version >= 4 ? sizeof(uint32_t) : 0);
+  if (header.table_offset > size || (size - header.table_offset) / entry_size < header.count) {
+    throw std::runtime_error("Bad snapshot");
+  }
+
+  std::vector<SnapshotEntry> table(header.count);
+  std::memcpy(table.data(), data + header.table_offset, header.count * sizeof(SnapshotEntry));
+  for (const auto& entry : table) {
+    if (entry.key_offset > size || entry.key_size > size - entry.key_offset
+        || entry.value_offset > size || entry.value_size > size - entry.value_offset) {
+      throw std::runtime_error("Bad snapshot");
+    }
+  }
+
+  // deserialization dominates load time, so spread it across cores
+  // compact storage keeps the serialized form, so it's skipped
+  std::vector<std::pair<helib::Ctxt, Chunks>> entries;
+  if (!compact_) {
+    entries.assign(header.count, {helib::Ctxt(*pkp_), Chunks()});
+    parallelFor(header.count * 2, [&](size_t i) {
+      const auto& entry = table[i / 2];
+      bool key = i % 2 == 0;
+      MemoryBuffer mem(data + (key ? entry.key_offset : entry.value_offset), key ? entry.key_size : entry.value_size);
+      std::istream is(&mem);
+      if (key) {
+        entries[i / 2].first = helib::Ctxt::readFrom(is, *pkp_.get());
+      } else {
+        entries[i / 2].second = readChunks(is, *pkp_.get());
+      }
+    });
+  }
+
+  std::vector<int64_t> expires(header.count, 0);
+  if (header.version >= 2) {
+    std::memcpy(expires.data(), data + header.table_offset + header.count * sizeof(SnapshotEntry), header.count * sizeof(int64_t));
+  }
+  std::vector<uint32_t> buckets(header.count, NO_BUCKET);
+  if (header.version >= 4) {
+    std::memcpy(buckets.data(), data + header.table_offset + header.count * (sizeof(SnapshotEntry) + sizeof(int64_t)), header.count * sizeof(uint32_t));
+  }
+
+  clear();
+  store_ = std::move(entries);
+  if (compact_) {
+    uint64_t total = 0;
+    for (const auto& entry : table) {
+      total += entry.key_size + entry.value_size;
+    }
+    arena_.reserve(total);
+  }
+  for (size_t i = 0; i < table.size(); i++) {
+    if (compact_) {
+      append(std::string(data + table[i].key_offset, table[i].key_size), std::string(data + table[i].value_offset, table[i].value_size));
+    }
+    sizes_.push_back(table[i].key_size + table[i].value_size);
+    bytes_ += sizes_.back();
+    addExpire(expires[i]);
+    addBucket(buckets[i]);
+  }
+  return header.table_offset + header.count * entry_size;
+}
+
+size_t loadSnapshot(const char* data, size_t size, Databases& dbs) {
+  for (auto& db : dbs) {
+    db->clear();
+  }
+
+  size_t pos = 0;
+  do {
+    SnapshotHeader header;
+    if (size - pos < sizeof(header)) {
+      throw std::runtime_error("Bad snapshot");
+    }
+    std::memcpy(&header, data + pos, sizeof(header));
+    // earlier versions only have the first database
+    uint32_t db = header.version >= 3 ? header.db : 0;
+    if (db >= dbs.size()) {
+      throw std::runtime_error("Snapshot has database " + std::to_string(db) + " but there are only " + std::to_string(dbs.size()));
+    }
+    pos += dbs[db]->load(data + pos, size - pos);
+  } while (pos < size && Store::isSnapshot(data + pos, size - pos));
+  return pos;
+}
+
+Databases createDatabases(const std::string& pk_path, size_t count, bool compact) {
+  auto [contextp, pkp] = loadContextAndKey<helib::PubKey>(pk_path, false);
+  std::shared_ptr<helib::Context> shared_contextp = std::move(contextp);
+  std::shared_ptr<helib::PubKey> shared_pkp = std::move(pkp);
+  // before any fork, and once for every database
+  uint64_t fingerprint = contextFingerprint(*shared_contextp);
+  Databases dbs;
+  for (size_t i = 0; i < count; i++) {
+    dbs.push_back(std::make_unique<Store>(shared_contextp, shared_pkp, compact, fingerprint));
+  }
+  return dbs;
 }
 
 } // namespace morph
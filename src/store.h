@@ -17,8 +17,13 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <ostream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <helib/helib.h>
@@ -27,23 +32,165 @@
 
 namespace morph {
 
+// stages of the equality kernel, exposed for benchmarks
+// takes the difference of two ciphertexts and leaves 1 in slots that were equal, 0 elsewhere
+void slotsEqual(helib::Ctxt& diff, long p);
+// takes slot results and leaves 1 in every slot only if all slots are 1
+void allSlots(helib::Ctxt& mask, const helib::EncryptedArray& ea);
+
+// unix time in milliseconds, which expiration times use
+int64_t unixTimeMs();
+
+// homomorphic operations and time spent in each stage, for tuning parameters
+struct HEStats {
+  uint64_t multiplications = 0;
+  // each rotation is an automorphism followed by a key switch
+  uint64_t rotations = 0;
+  // primes dropped from the modulus chain
+  uint64_t modulus_switches = 0;
+  uint64_t deserializations = 0;
+  double deserialize_usec = 0;
+  double subtract_usec = 0;
+  double power_usec = 0;
+  double rotate_usec = 0;
+  double multiply_usec = 0;
+  double accumulate_usec = 0;
+  double serialize_usec = 0;
+  uint64_t results = 0;
+  // lowest remaining noise budget of results in bits
+  long bit_capacity = 0;
+
+  void add(const HEStats& other);
+};
+
+// a value as one or more ciphertexts, so it can be longer than the slot count
+using Chunks = std::vector<helib::Ctxt>;
+
+// bucket of entries set without a bucket tag, which every get scans
+const uint32_t NO_BUCKET = UINT32_MAX;
+
 class Store {
   public:
     Store(const std::string& pk_path) {
       std::tie(contextp_, pkp_) = loadContextAndKey<helib::PubKey>(pk_path, false);
+      fingerprint_ = contextFingerprint(*contextp_);
     }
-    void set(const std::string& key, const std::string& value);
-    std::string get(const std::string& key);
+    // compact stores entries serialized in one buffer and deserializes them
+    // a chunk at a time when scanning, which uses fewer allocations but more CPU
+    // fingerprint is of the context, so stores that share one compute it once, or 0 to compute it here
+    Store(std::shared_ptr<helib::Context> contextp, std::shared_ptr<helib::PubKey> pkp, bool compact = false, uint64_t fingerprint = 0)
+      : contextp_(contextp), pkp_(pkp), compact_(compact), fingerprint_(fingerprint != 0 ? fingerprint : contextFingerprint(*contextp)) {}
+    // expire_at is unix time in milliseconds, or 0 to never expire
+    void set(const std::string& key, const std::string& value, int64_t expire_at = 0, uint32_t bucket = NO_BUCKET);
+    // deserializes in parallel and appends in order
+    // expires and buckets are empty or have an expiration time and tag for each pair
+    void setMany(const std::vector<std::pair<std::string, std::string>>& pairs, const std::vector<int64_t>& expires = {}, const std::vector<uint32_t>& buckets = {});
+    // skips expired entries that haven't been removed yet
+    // with a bucket, only scans entries in it and entries without one
+    std::string get(const std::string& key, uint32_t bucket = NO_BUCKET);
+    // like get for each key, but scans entries once for all of them
+    // buckets is empty or has a tag for each key
+    std::vector<std::string> getMany(const std::vector<std::string>& keys, const std::vector<uint32_t>& buckets = {});
+    // values of the keys in ranges of width slots, rotated into place and added together,
+    // so each result holds as many values as fit and the client decrypts fewer ciphertexts
+    std::vector<std::string> getPacked(const std::vector<std::string>& keys, const std::vector<uint32_t>& buckets, size_t width);
+    // encrypted number of entries with any of the keys in every slot, without touching values
+    std::string exists(const std::vector<std::string>& keys, const std::vector<uint32_t>& buckets = {});
     void clear();
     std::vector<std::string> keys();
+    // serialized keys in a range of positions
+    std::vector<std::string> keys(size_t start, size_t count);
     int size();
+    // serialized size of all keys and values
+    uint64_t bytes();
+    bool compact();
+    // values longer than this, including the prefix, are split into chunks
+    size_t slots();
+    // serialized keys and values, interleaved, for moving entries between servers,
+    // with the expiration time and bucket tag of each entry
+    std::vector<std::string> dump(size_t start, size_t count, std::vector<int64_t>& expires, std::vector<uint32_t>& buckets);
+    void erase(size_t start, size_t count);
+    // removes entries that expired by the given time and returns how many
+    size_t expire(int64_t now);
+    // entries with an expiration time
+    size_t expiring();
+
+    // writes a snapshot section for the given database
+    // progress is called with the number of entries written so far
+    void write(std::ostream& file, uint32_t db, const std::function<void(size_t)>& progress = nullptr);
+    // reads one section and returns its size
+    size_t load(const char* data, size_t size);
+    static bool isSnapshot(const char* data, size_t size);
+
+    // returns stats since the last call and resets them
+    HEStats takeStats();
+    // runs the equality kernel once so tables HElib builds on first use
+    // are ready before the first query
+    void warmUp();
 
   private:
-    std::vector<std::pair<helib::Ctxt, helib::Ctxt>> store_;
+    // expanded entries, or empty with compact storage
+    std::vector<std::pair<helib::Ctxt, Chunks>> store_;
+    // serialized keys and values with compact storage, and where each entry starts
+    std::string arena_;
+    std::vector<uint64_t> offsets_;
+    std::vector<uint32_t> key_sizes_;
+    // serialized size of each entry
+    std::vector<uint32_t> sizes_;
+    uint64_t bytes_ = 0;
+    // expiration time of each entry, or 0 for none
+    std::vector<int64_t> expires_;
+    size_t expiring_ = 0;
+    // nothing expires before this, so most expire calls don't scan
+    int64_t next_expire_ = 0;
+    // bucket tag of each entry, and positions of entries in each bucket
+    std::vector<uint32_t> buckets_;
+    std::unordered_map<uint32_t, std::vector<size_t>> index_;
     std::shared_ptr<helib::Context> contextp_;
-    std::unique_ptr<helib::PubKey> pkp_;
+    std::shared_ptr<helib::PubKey> pkp_;
+    bool compact_ = false;
+    // computed when the store is created, since it serializes the context,
+    // so background saves don't repeat it in each child
+    uint64_t fingerprint_ = 0;
+    HEStats stats_;
 
     helib::Ctxt stringToCtxt(const std::string& str);
+    Chunks stringToChunks(const std::string& str);
+    void append(const std::string& key, const std::string& value);
+    // serialized key or value of an entry
+    std::string serialized(size_t i, bool key);
+    // calls fn with the position of each entry at the positions that hasn't expired,
+    // expanding compact entries (only keys unless values is true) in parallel a chunk at a time
+    void forEachEntry(const std::vector<size_t>& positions, bool values, std::chrono::steady_clock::time_point& start,
+      const std::function<void(size_t, const helib::Ctxt&, const Chunks&)>& fn);
+    // 1 in every slot when the keys are equal, 0 otherwise
+    helib::Ctxt keyMask(const helib::Ctxt& stored_key, const helib::Ctxt& key, std::chrono::steady_clock::time_point& start);
+    std::string serializeResult(const helib::Ctxt& value, std::chrono::steady_clock::time_point& start);
+    std::vector<helib::Ctxt> parseKeys(const std::vector<std::string>& keys, std::chrono::steady_clock::time_point& start);
+    // for each key, the sum of the values of entries times their masks, chunk by chunk,
+    // or empty when none are scanned
+    std::vector<Chunks> lookup(const std::vector<helib::Ctxt>& keys, const std::vector<uint32_t>& buckets, std::chrono::steady_clock::time_point& start);
+    void addExpire(int64_t expire_at);
+    void addBucket(uint32_t bucket);
+    // positions change when entries are removed
+    void rebuildIndex();
+    // positions to scan for keys in the buckets, in order, which is every entry without one
+    std::vector<size_t> candidates(const std::vector<uint32_t>& buckets);
+    // whether a key in the bucket is compared with the entry
+    bool inBucket(size_t i, uint32_t bucket);
 };
 
+// numbered logical databases, which share a context and key
+using Databases = std::vector<std::unique_ptr<Store>>;
+
+// loads the context and key once for all of them
+Databases createDatabases(const std::string& pk_path, size_t count, bool compact = false);
+
+// snapshots are written to a temporary file and renamed into place
+// progress is called with the number of entries written so far
+void saveSnapshot(const std::string& path, const Databases& dbs, const std::function<void(size_t)>& progress = nullptr);
+void loadSnapshot(const std::string& path, Databases& dbs);
+// returns the size of the snapshot so data after it can be read
+size_t loadSnapshot(const char* data, size_t size, Databases& dbs);
+
 } // namespace morph